@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -16,76 +16,315 @@
 
 #include "types.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
 
-struct {
+// Buffers are found through a hash table keyed by (dev, blockno),
+// with a lock per bucket, so that lookups of different blocks
+// rarely contend.
+//
+// The cache grows a page at a time, BPERPG buffers per page,
+// up to 1/BCACHEFRAC of RAM, and gives pages back to kalloc()
+// when it runs out of memory, down to NBUF buffers. Once it
+// can't grow, a miss recycles an unused buffer chosen by a
+// CLOCK hand sweeping the pages.
+#define NBUCKET 1031
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+#define BPERPG  (PGSIZE / BSIZE)
+#define BSHRINK 16  // most pages given back per bshrink()
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;
+};
+
+// a page of buffer data and the buffers that use it.
+struct bchunk {
+  struct bchunk *next;
+  struct buf buf[BPERPG];
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  // held while growing, shrinking or recycling, so that only
+  // one cpu at a time moves buffers between buckets and two
+  // cpus can't both cache the same block.
+  struct spinlock lock;
+  struct bchunk *chunks;
+  struct buf *spare;    // buffers not yet used, through next
+  struct bchunk *hand;  // CLOCK hand: next buffer to look at
+  int handi;
+  int n;                // buffers in the cache
+  int max;
+  int nwait;            // bget()s looking for a buffer to recycle
+  struct bucket bucket[NBUCKET];
 } bcache;
 
-void
-binit(void)
+static struct bucket *
+bbucket(struct buf *b)
 {
-  struct buf *b;
+  return &bcache.bucket[BHASH(b->dev, b->blockno)];
+}
 
-  initlock(&bcache.lock, "bcache");
+static void
+bunlink(struct bucket *bk, struct buf *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    bk->head = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+}
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+static void
+blink(struct bucket *bk, struct buf *b)
+{
+  b->prev = 0;
+  b->next = bk->head;
+  if(bk->head)
+    bk->head->prev = b;
+  bk->head = b;
+}
+
+// Add a page of buffers, holding no block, to the cache's
+// spares. Spares are in no bucket, and hold a reference so
+// that bclock() and bshrink() leave them alone.
+// Caller holds bcache.lock.
+static struct bchunk*
+bgrow(void)
+{
+  struct bchunk *c;
+  uchar *data;
+  struct buf *b;
+
+  if(bcache.n + BPERPG > bcache.max)
+    return 0;
+  if((c = kmalloc(sizeof(*c))) == 0)
+    return 0;
+  if((data = kalloc()) == 0){
+    kmfree(c);
+    return 0;
+  }
+  memset(c, 0, sizeof(*c));
+  for(b = c->buf; b < c->buf+BPERPG; b++){
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->data = data + (b - c->buf) * BSIZE;
+    b->refcnt = 1;
+    b->next = bcache.spare;
+    bcache.spare = b;
   }
+  c->next = bcache.chunks;
+  bcache.chunks = c;
+  if(bcache.hand == 0)
+    bcache.hand = c;
+  bcache.n += BPERPG;
+  return c;
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// If no one holds b, take it out of its bucket.
+// Caller holds bcache.lock.
+static int
+btake(struct buf *b)
+{
+  struct bucket *bk = bbucket(b);
+  int ok = 0;
+
+  acquire(&bk->lock);
+  if(b->refcnt == 0){
+    bunlink(bk, b);
+    ok = 1;
+  }
+  release(&bk->lock);
+  return ok;
+}
+
+// Sweep the CLOCK hand over the buffers for an unused one
+// that hasn't been looked up since the hand last passed it,
+// and take it out of its bucket. Returns 0 if every buffer
+// is in use. Caller holds bcache.lock.
 static struct buf*
-bget(uint dev, uint blockno)
+bclock(void)
 {
+  struct bucket *bk;
   struct buf *b;
 
+  for(int i = 0; i < 2*bcache.n; i++){
+    b = &bcache.hand->buf[bcache.handi];
+    if(++bcache.handi == BPERPG){
+      bcache.handi = 0;
+      bcache.hand = bcache.hand->next ? bcache.hand->next : bcache.chunks;
+    }
+    bk = bbucket(b);
+    acquire(&bk->lock);
+    if(b->refcnt == 0){
+      if(b->used){
+        b->used = 0;
+      } else {
+        bunlink(bk, b);
+        release(&bk->lock);
+        return b;
+      }
+    }
+    release(&bk->lock);
+  }
+  return 0;
+}
+
+void
+binit(void)
+{
+  struct bucket *bk;
+
+  initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+  bcache.max = (PHYSTOP - KERNBASE) / BCACHEFRAC / BSIZE;
+
   acquire(&bcache.lock);
+  while(bcache.n < NBUF)
+    if(bgrow() == 0)
+      panic("binit");
+  release(&bcache.lock);
+}
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+// Give up to BSHRINK pages of unused buffers back to kalloc(),
+// which calls this when it runs out of memory. Does nothing
+// if the caller holds a spinlock, which might be one bget()
+// needs. Returns the number of pages freed.
+int
+bshrink(void)
+{
+  struct bchunk *c, **cp;
+  int i, j, nlock, freed = 0;
+
+  push_off();
+  nlock = mycpu()->noff;
+  pop_off();
+  if(nlock > 1)
+    return 0;
+
+  acquire(&bcache.lock);
+  cp = &bcache.chunks;
+  while((c = *cp) != 0 && freed < BSHRINK && bcache.n - BPERPG >= NBUF){
+    for(i = 0; i < BPERPG; i++)
+      if(!btake(&c->buf[i]))
+        break;
+    if(i < BPERPG){
+      // some buffer is in use; put the others back.
+      for(j = 0; j < i; j++){
+        acquire(&bbucket(&c->buf[j])->lock);
+        blink(bbucket(&c->buf[j]), &c->buf[j]);
+        release(&bbucket(&c->buf[j])->lock);
+      }
+      cp = &c->next;
+      continue;
+    }
+    *cp = c->next;
+    if(bcache.hand == c){
+      bcache.hand = c->next ? c->next : bcache.chunks;
+      bcache.handi = 0;
+    }
+    bcache.n -= BPERPG;
+    kfree(c->buf[0].data);
+    kmfree(c);
+    freed++;
+  }
+  release(&bcache.lock);
+  return freed;
+}
+
+// Look for block blockno of dev in bucket bk, whose lock
+// must be held, and take a reference to it if it's there.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b != 0; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      b->used = 1;
       return b;
     }
   }
+  return 0;
+}
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer, waiting for one to be
+// released if all are in use and wait is set; otherwise
+// return 0 in that case.
+// Return the buffer with a reference but not locked.
+static struct buf*
+bref(uint dev, uint blockno, int wait)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  struct buf *b;
+
+  // Is the block already cached?
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b)
+    return b;
+
+  // Not cached. Check again with bcache.lock held, in case
+  // another cpu cached it in the meantime, then grow the
+  // cache or recycle a buffer. nwait tells brelse() that
+  // someone may be waiting; it is raised before looking at
+  // any buffer, so a release can't slip by unnoticed.
+  acquire(&bcache.lock);
+  bcache.nwait++;
+  for(;;){
+    acquire(&bk->lock);
+    b = bfind(bk, dev, blockno);
+    release(&bk->lock);
+    if(b)
+      break;
+
+    if(bcache.spare == 0)
+      bgrow();
+    if((b = bcache.spare) != 0)
+      bcache.spare = b->next;
+    else
+      b = bclock();
+    if(b){
       b->dev = dev;
       b->blockno = blockno;
       b->valid = 0;
       b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      b->used = 1;
+      acquire(&bk->lock);
+      blink(bk, b);
+      release(&bk->lock);
+      break;
     }
+
+    // every buffer is in use; wait for one to be released.
+    if(!wait)
+      break;
+    sleep(&bcache, &bcache.lock);
   }
-  panic("bget: no buffers");
+  bcache.nwait--;
+  release(&bcache.lock);
+  return b;
+}
+
+// Return a locked buffer for block blockno of dev.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bref(dev, blockno, 1);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -111,8 +350,54 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Drop a reference to b, waking bget()s waiting for a
+// buffer if it was the last.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk = bbucket(b);
+  int last;
+
+  acquire(&bk->lock);
+  last = --b->refcnt == 0;
+  release(&bk->lock);
+
+  if(last && __atomic_load_n(&bcache.nwait, __ATOMIC_SEQ_CST) > 0){
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
+  }
+}
+
+// Start writing the contents of the n bufs in bs to disk
+// without waiting, so that several writes can be in flight.
+// Runs of consecutive blocks become a single disk request,
+// of at most virtio_disk_maxseg() blocks each.
+// The bufs must be locked, and stay locked until bwait().
+void
+bstart(struct buf **bs, int n)
+{
+  int i, j, max = virtio_disk_maxseg();
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bstart");
+  for(i = 0; i < n; i = j){
+    for(j = i+1; j < n && j-i < max; j++)
+      if(bs[j]->dev != bs[i]->dev || bs[j]->blockno != bs[i]->blockno + (j-i))
+        break;
+    virtio_disk_submit(bs+i, j-i, 1);
+  }
+}
+
+// Wait for the write of b started by bstart() to finish.
+void
+bwait(struct buf *b)
+{
+  virtio_disk_wait(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +405,75 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bbucket(b);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
+  bput(b);
 }
 
+// start reading the n locked bufs in bs as one disk request,
+// or release them if the disk queue is full.
+static void
+bstartread(struct buf **bs, int n)
+{
+  if(n > 0 && virtio_disk_start(bs, n) < 0)
+    for(int i = 0; i < n; i++)
+      brelse(bs[i]);
+}
+
+// Start reading the n blocks of dev in blocknos into the
+// cache, skipping those already there, without waiting for
+// the disk. Runs of consecutive blocks become a single disk
+// request. Gives up quietly on blocks for which no buffer or
+// disk descriptor is free. n is at most MAXSEG.
+void
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *bs[MAXSEG], *b;
+  int nb = 0, max = virtio_disk_maxseg();
 
+  if(n > MAXSEG)
+    panic("breadahead");
+  for(int i = 0; i < n; i++){
+    if((b = bref(dev, blocknos[i], 0)) == 0)
+      continue;
+    // a buffer stays valid while we hold a reference.
+    if(b->valid){
+      bput(b);
+      continue;
+    }
+    acquiresleep(&b->lock);
+    if(b->valid){
+      brelse(b);
+      continue;
+    }
+    if(nb == max || (nb > 0 && b->blockno != bs[nb-1]->blockno + 1)){
+      bstartread(bs, nb);
+      nb = 0;
+    }
+    bs[nb++] = b;
+  }
+  bstartread(bs, nb);
+}
+
+// Called by the disk driver when a read started by
+// breadahead() has finished, possibly in an interrupt.
+// Marks b valid and releases it.
+void
+bdone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
@@ -5,8 +5,10 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  int used;         // looked up since the CLOCK hand passed
+  struct buf *prev; // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *qnext; // next buf in the same disk request
+  uchar *data;      // BSIZE bytes, in a page shared with other bufs
 };
 
@@ -84,6 +84,8 @@ consoleread(int user_dst, uint64 dst, int n)
   char cbuf;
 
   target = n;
+  if(user_dst)
+    uvmprefault(myproc()->pagetable, dst, n < INPUT_BUF_SIZE ? n : INPUT_BUF_SIZE, 1);
   acquire(&cons.lock);
   while(n > 0){
     // wait until interrupt handler has put some
@@ -8,14 +8,22 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct timer;
+struct schedstat;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bstart(struct buf**, int);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(void);
+void            breadahead(uint, uint*, int);
+void            bdone(struct buf*);
 
 // console.c
 void            consoleinit(void);
@@ -45,6 +53,9 @@ void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
+void*           itextget(struct inode*, uint);
+void            itextput(struct inode*, uint, void*);
+void            itextdrop(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
@@ -63,6 +74,20 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kincref(void *);
+void*           kallocorder(int);
+void            kfreeorder(void *, int);
+void*           kzalloc(void);
+int             kzerofill(void);
+int             krefcnt(void *);
+void*           ksuperalloc(void);
+void            ksuperfree(void *);
+void            ksupersplit(void *);
+
+// kmalloc.c
+void            kmallocinit(void);
+void*           kmalloc(uint64);
+void            kmfree(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -90,6 +115,8 @@ void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+int             getsched(int, struct schedstat*);
+int             setsched(int, int, int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
@@ -142,12 +169,23 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            timer_add(struct timer*, uint);
+void            timer_del(struct timer*);
+int             timer_next(uint*);
+void            timer_run(void);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            clockupdate(void);
+void            clockidle(void);
+void            clockbusy(void);
+void            clockarm(uint);
+void            ipi_send(int);
 
 // uart.c
 void            uartinit(void);
@@ -166,10 +204,22 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             vmfault(pagetable_t, uint64, int);
+void            uvmprefault(pagetable_t, uint64, uint64, int);
+void            vmadup(struct vma*, struct vma*);
+void            vmaput(pagetable_t, struct vma*);
+int             vmacopy(pagetable_t, pagetable_t, struct vma*);
+int             vmaoverlap(struct proc*, uint64, uint64);
+uint64          mmap(uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walklevel(pagetable_t, uint64, int, int*);
+int             uvmsplit(pagetable_t, uint64);
+uint64          uvmasid(struct proc*);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -184,6 +234,10 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
+int             virtio_disk_start(struct buf **, int);
+int             virtio_disk_maxseg(void);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -14,9 +14,11 @@
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+// open files are allocated with kmalloc(); NFILE
+// only limits how many there can be.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  int n;
 } ftable;
 
 void
@@ -32,15 +34,22 @@ filealloc(void)
   struct file *f;
 
   acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(ftable.n >= NFILE){
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.n++;
   release(&ftable.lock);
-  return 0;
+
+  if((f = kmalloc(sizeof(struct file))) == 0){
+    acquire(&ftable.lock);
+    ftable.n--;
+    release(&ftable.lock);
+    return 0;
+  }
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -71,7 +80,9 @@ fileclose(struct file *f)
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
+  ftable.n--;
   release(&ftable.lock);
+  kmfree(f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -118,10 +129,33 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    // fault in the user buffer before locking the inode, a
+    // chunk at a time. filling a page of a mapped file takes
+    // that file's inode and buffer locks, which can deadlock
+    // against the ones readi() holds while it copies out.
+    int max = 16 * PGSIZE;
+    int i = 0;
+    while(i < n){
+      int n1 = n - i;
+      if(n1 > max)
+        n1 = max;
+
+      uvmprefault(myproc()->pagetable, addr + i, n1, 1);
+      ilock(f->ip);
+      if((r = readi(f->ip, 1, addr + i, f->off, n1)) > 0)
+        f->off += r;
+      iunlock(f->ip);
+
+      if(r < 0){
+        if(i == 0)
+          i = -1;
+        break;
+      }
+      i += r;
+      if(r != n1)
+        break; // end of file
+    }
+    r = i;
   } else {
     panic("fileread");
   }
@@ -159,6 +193,8 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      // as in fileread(), before taking any fs locks.
+      uvmprefault(myproc()->pagetable, addr + i, n1, 0);
       begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
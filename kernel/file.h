@@ -27,6 +27,10 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+  uint64 *text;       // shared text pages, see itextget()
+  uint ralast;        // last block of the previous read, see readahead()
+  uint raend;         // first block not yet read ahead
+  uint rawin;         // read-ahead window, in blocks
 };
 
 // map major device number to device functions.
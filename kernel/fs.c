@@ -271,6 +271,7 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ralast = ip->raend = ip->rawin = 0;
   release(&itable.lock);
 
   return ip;
@@ -338,6 +339,11 @@ iput(struct inode *ip)
 {
   acquire(&itable.lock);
 
+  if(ip->ref == 1 && ip->text){
+    // no process is running this file any more.
+    itextdrop(ip);
+  }
+
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
 
@@ -369,6 +375,71 @@ iunlockput(struct inode *ip)
   iput(ip);
 }
 
+// Shared text pages.
+//
+// Pages of read-only program segments are cached per inode
+// so that every process running the same binary maps the
+// same physical pages. ip->text is a page of physical
+// addresses indexed by file page number, so only the first
+// TEXTPAGES pages of a file can be shared. The cache holds
+// one reference on each page (see kincref()); each mapping
+// holds another. The cache is dropped when the inode's last
+// reference goes away or the file is written.
+
+#define TEXTPAGES (PGSIZE / sizeof(uint64))
+
+// Return the cached page at file offset off with a new
+// reference for the caller, or 0 if there is none.
+// Caller must hold ip->lock.
+void*
+itextget(struct inode *ip, uint off)
+{
+  void *pa;
+
+  if(!holdingsleep(&ip->lock))
+    panic("itextget");
+  if(ip->text == 0 || off % PGSIZE != 0 || off / PGSIZE >= TEXTPAGES)
+    return 0;
+  pa = (void*)ip->text[off / PGSIZE];
+  if(pa)
+    kincref(pa);
+  return pa;
+}
+
+// Add page pa, holding the contents of the file at off,
+// to the cache. Does nothing if off can't be cached.
+// Caller must hold ip->lock.
+void
+itextput(struct inode *ip, uint off, void *pa)
+{
+  if(!holdingsleep(&ip->lock))
+    panic("itextput");
+  if(off % PGSIZE != 0 || off / PGSIZE >= TEXTPAGES)
+    return;
+  if(ip->text == 0){
+    if((ip->text = kzalloc()) == 0)
+      return;
+  }
+  if(ip->text[off / PGSIZE])
+    return;
+  kincref(pa);
+  ip->text[off / PGSIZE] = (uint64)pa;
+}
+
+// Drop the cache's references on all of ip's text pages.
+// Processes that still map them keep theirs.
+void
+itextdrop(struct inode *ip)
+{
+  if(ip->text == 0)
+    return;
+  for(int i = 0; i < TEXTPAGES; i++)
+    if(ip->text[i])
+      kfree((void*)ip->text[i]);
+  kfree(ip->text);
+  ip->text = 0;
+}
+
 // Inode content
 //
 // The content (data) associated with each inode is stored
@@ -429,6 +500,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  itextdrop(ip);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -464,6 +537,58 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Sequential read-ahead. A read that starts in or just
+// after the block where the previous read of ip ended is
+// sequential; each one doubles the read-ahead window, up to
+// RAMAX blocks, and anything else closes it. Before readi()
+// copies out the first block, the disk is asked for the rest
+// of the read and the window beyond it, so those blocks are
+// on their way while readi() waits for the first.
+// Caller must hold ip->lock.
+#define RAMIN 4
+#define RAMAX 32
+
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint first, last, end, bn, addr;
+  uint blocks[MAXSEG];
+  int nb = 0;
+
+  if(n == 0)
+    return;
+  first = off / BSIZE;
+  last = (off + n - 1) / BSIZE;
+  if(first == ip->ralast || first == ip->ralast + 1){
+    ip->rawin = ip->rawin ? ip->rawin * 2 : RAMIN;
+    if(ip->rawin > RAMAX)
+      ip->rawin = RAMAX;
+  } else {
+    ip->rawin = 0;
+    ip->raend = 0;
+  }
+  ip->ralast = last;
+  if(ip->rawin == 0)
+    return;
+
+  // only blocks within the file, which bmap() won't allocate.
+  end = last + ip->rawin;
+  if(end > (ip->size - 1) / BSIZE)
+    end = (ip->size - 1) / BSIZE;
+  bn = ip->raend > first + 1 ? ip->raend : first + 1;
+  for(; bn <= end; bn++){
+    if((addr = bmap(ip, bn)) == 0)
+      break;
+    if(nb == MAXSEG){
+      breadahead(ip->dev, blocks, nb);
+      nb = 0;
+    }
+    blocks[nb++] = addr;
+  }
+  breadahead(ip->dev, blocks, nb);
+  ip->raend = bn;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -479,6 +604,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  readahead(ip, off, n);
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
@@ -513,6 +640,9 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  // programs exec'd from now on must see the new contents.
+  itextdrop(ip);
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
@@ -1,6 +1,9 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. A buddy allocator hands out
+// power-of-two runs of physically contiguous pages,
+// such as 2MB superpages for megapage mappings;
+// single 4096-byte pages come from per-cpu caches.
 
 #include "types.h"
 #include "param.h"
@@ -16,50 +19,384 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;  // only in kmem's lists
 };
 
+#define NPAGE  ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+// the buddy allocator. a free block of order k is 2^k pages,
+// aligned to its size, and sits on list free[k]; when both
+// halves of a block of order k+1 are free, they are merged.
+// kfreeord[] holds k+1 for the first page of each free block,
+// and 0 for every other page.
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run *free[MAXORDER+1];
 } kmem;
 
+uchar kfreeord[NPAGE];
+
+// each cpu keeps a small cache of free pages so that most
+// kalloc()/kfree() calls don't touch kmem.lock. pages move
+// between a cache and kmem in batches of KBATCH. a cache's lock
+// is normally taken only by its own cpu; other cpus take it
+// to steal pages when kmem is empty.
+#define KCACHEMAX 64   // drain a batch when a cache grows to this
+#define KBATCH    16   // pages moved per refill, drain or steal
+
+struct kcache {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+} kcache[NCPU];
+
+// pages zeroed by idle cpus, for kzalloc(). they are
+// allocated pages with one reference, so that kalloc()
+// can fall back on them when memory is short.
+#define KZEROMAX 128
+
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+} kzero;
+
+// reference count of each physical page, for pages shared
+// copy-on-write after fork. kalloc() sets it to 1, kfree()
+// drops one reference and frees the page on the last one.
+// a block of more than one page is counted in the entry
+// of its first page.
+int kref[NPAGE];
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  initlock(&kzero.lock, "kzero");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcache[i].lock, "kcache");
   freerange(end, (void*)PHYSTOP);
 }
 
+static void
+buddypush(int k, struct run *r)
+{
+  r->prev = 0;
+  r->next = kmem.free[k];
+  if(r->next)
+    r->next->prev = r;
+  kmem.free[k] = r;
+  kfreeord[PA2REF(r)] = k + 1;
+}
+
+static void
+buddyremove(int k, struct run *r)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.free[k] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  kfreeord[PA2REF(r)] = 0;
+}
+
+// take a block of order k, splitting a bigger one if
+// needed, or return 0. called with kmem.lock held.
+static char *
+buddyalloc(int k)
+{
+  struct run *r;
+  int j;
+
+  for(j = k; j <= MAXORDER && kmem.free[j] == 0; j++)
+    ;
+  if(j > MAXORDER)
+    return 0;
+  r = kmem.free[j];
+  buddyremove(j, r);
+  // give back the upper halves.
+  while(j > k){
+    j--;
+    buddypush(j, (struct run*)((char*)r + (PGSIZE << j)));
+  }
+  return (char*)r;
+}
+
+// free the block pa of order k, merging it with its buddy
+// for as long as the buddy is free too.
+// called with kmem.lock held.
+static void
+buddyfree(char *pa, int k)
+{
+  uint64 b;
+
+  for(; k < MAXORDER; k++){
+    b = KERNBASE + (((uint64)pa - KERNBASE) ^ (PGSIZE << k));
+    if(b >= PHYSTOP || kfreeord[PA2REF(b)] != k + 1)
+      break;
+    buddyremove(k, (struct run*)b);
+    if(b < (uint64)pa)
+      pa = (char*)b;
+  }
+  buddypush(k, (struct run*)pa);
+}
+
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&kmem.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    buddyfree(p, 0);
+  release(&kmem.lock);
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// add a reference to a page that is already allocated.
 void
-kfree(void *pa)
+kincref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kincref");
+  __sync_fetch_and_add(&kref[PA2REF(pa)], 1);
+}
+
+// number of references to an allocated page.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&kref[PA2REF(pa)], __ATOMIC_SEQ_CST);
+}
+
+// detach up to n pages from the front of *list.
+// returns the chain and sets *tail and *got.
+static struct run *
+takepages(struct run **list, int n, struct run **tail, int *got)
+{
+  struct run *head = *list, *r = 0;
+  int i;
+
+  for(i = 0; i < n && *list; i++){
+    r = *list;
+    *list = r->next;
+  }
+  if(r)
+    r->next = 0;
+  *tail = r;
+  *got = i;
+  return i ? head : 0;
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Returns 0 if there is no such block.
+// The contents are junk.
+void *
+kallocorder(int order)
+{
+  char *pa;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  acquire(&kmem.lock);
+  pa = buddyalloc(order);
+  release(&kmem.lock);
+  if(pa)
+    kref[PA2REF(pa)] = 1;
+  return pa;
+}
+
+// Drop a reference to the block pa of 2^order pages, from
+// kallocorder(), freeing it on the last one.
+void
+kfreeorder(void *pa, int order)
+{
+  int n;
+
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || ((uint64)pa % (PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfreeorder");
+  n = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1);
+  if(n < 0)
+    panic("kfreeorder: ref");
+  if(n > 0)
+    return;
+  acquire(&kmem.lock);
+  buddyfree(pa, order);
+  release(&kmem.lock);
+}
+
+// Allocate one 2MB superpage, aligned to its size.
+// Returns 0 if none is free. Its contents are junk.
+void *
+ksuperalloc(void)
+{
+  return kallocorder(SUPERORDER);
+}
+
+// Drop a reference to superpage pa, freeing it on the last.
+void
+ksuperfree(void *pa)
+{
+  kfreeorder(pa, SUPERORDER);
+}
+
+// Turn the superpage pa, which has one reference, into
+// 512 ordinary pages of one reference each, for a megapage
+// mapping that is being split. They are freed with kfree().
+void
+ksupersplit(void *pa)
+{
+  if(((uint64)pa % SUPERPGSIZE) != 0 || kref[PA2REF(pa)] != 1)
+    panic("ksupersplit");
+  for(int i = 1; i < SUPERPGSIZE / PGSIZE; i++)
+    kref[PA2REF(pa) + i] = 1;
+}
+
+// take a page from the pool of zeroed pages, or return 0.
+static struct run *
+kzerotake(void)
 {
   struct run *r;
 
+  acquire(&kzero.lock);
+  r = kzero.freelist;
+  if(r){
+    kzero.freelist = r->next;
+    kzero.n--;
+  }
+  release(&kzero.lock);
+  return r;
+}
+
+// find a batch of pages for cpu id, whose cache is empty:
+// first from kmem, otherwise steal half of another cpu's cache.
+// called with interrupts off and no kcache lock held.
+static struct run *
+refill(int id, struct run **tail, int *got)
+{
+  struct run *r, *head = 0;
+
+  acquire(&kmem.lock);
+  for(*got = 0; *got < KBATCH && (r = (struct run*)buddyalloc(0)) != 0; (*got)++){
+    if(head == 0)
+      *tail = r;
+    r->next = head;
+    head = r;
+  }
+  release(&kmem.lock);
+  if(head)
+    return head;
+
+  for(int i = 0; i < NCPU; i++){
+    if(i == id)
+      continue;
+    struct kcache *kc = &kcache[i];
+    acquire(&kc->lock);
+    int n = (kc->n + 1) / 2;
+    r = takepages(&kc->freelist, n < KBATCH ? n : KBATCH, tail, got);
+    kc->n -= *got;
+    release(&kc->lock);
+    if(r)
+      return r;
+  }
+  return 0;
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
+// (The exception is when initializing the allocator; see
+// kinit above.)
+void
+kfree(void *pa)
+{
+  struct run *r, *chain, *tail;
+  struct kcache *kc;
+  int got, n;
+
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  n = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1);
+  if(n < 0)
+    panic("kfree: ref");
+  if(n > 0)
+    return;
+
+#ifdef KJUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  kc = &kcache[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->n++;
+  chain = 0;
+  if(kc->n >= KCACHEMAX){
+    chain = takepages(&kc->freelist, KBATCH, &tail, &got);
+    kc->n -= got;
+  }
+  release(&kc->lock);
+
+  if(chain){
+    // cache is full; hand a batch back to the buddy allocator.
+    acquire(&kmem.lock);
+    for(r = chain; r; r = tail){
+      tail = r->next;
+      buddyfree((char*)r, 0);
+    }
+    release(&kmem.lock);
+  }
+  pop_off();
+}
+
+// take a page from this cpu's cache, refilling it if empty.
+// returns 0 if the cache and the buddy allocator are both
+// out of pages; doesn't touch the zero pool or the bcache.
+static struct run *
+kcachealloc(void)
+{
+  struct run *r, *tail;
+  struct kcache *kc;
+  int id, got;
+
+  push_off();
+  id = cpuid();
+  kc = &kcache[id];
+
+  acquire(&kc->lock);
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->n--;
+  }
+  release(&kc->lock);
+
+  if(r == 0 && (r = refill(id, &tail, &got)) != 0){
+    // keep the first page, cache the rest.
+    if(r->next){
+      acquire(&kc->lock);
+      tail->next = kc->freelist;
+      kc->freelist = r->next;
+      kc->n += got - 1;
+      release(&kc->lock);
+    }
+  }
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +407,65 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+again:
+  r = kcachealloc();
+  if(r == 0)
+    r = kzerotake();
+  if(r == 0 && bshrink() > 0)
+    goto again;
 
-  if(r)
+  if(r){
+#ifdef KJUNK
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+    kref[PA2REF(r)] = 1;
+  }
   return (void*)r;
 }
+
+// Fill the pool of zeroed pages by one page, if it isn't
+// full. Called by idle cpus in scheduler(), so that most
+// pages that must start out zero needn't be zeroed when
+// they're needed. Returns 1 if it zeroed a page.
+// Takes only free pages: unlike kalloc() it must not take
+// from the pool it is filling, or shrink the buffer cache.
+int
+kzerofill(void)
+{
+  char *pa;
+
+  if(__atomic_load_n(&kzero.n, __ATOMIC_RELAXED) >= KZEROMAX)
+    return 0;
+  if((pa = (char*)kcachealloc()) == 0)
+    return 0;
+  kref[PA2REF(pa)] = 1;
+  memset(pa, 0, PGSIZE);
+  acquire(&kzero.lock);
+  if(kzero.n >= KZEROMAX){
+    release(&kzero.lock);
+    kfree(pa);
+    return 0;
+  }
+  ((struct run*)pa)->next = kzero.freelist;
+  kzero.freelist = (struct run*)pa;
+  kzero.n++;
+  release(&kzero.lock);
+  return 1;
+}
+
+// Allocate one page of physical memory, filled with zeros.
+// Returns 0 if the memory cannot be allocated.
+void *
+kzalloc(void)
+{
+  struct run *r;
+  char *pa;
+
+  if((r = kzerotake()) != 0){
+    r->next = 0;  // the rest is still zero
+    return (void*)r;
+  }
+  if((pa = kalloc()) != 0)
+    memset(pa, 0, PGSIZE);
+  return pa;
+}
@@ -0,0 +1,248 @@
+// Allocator for small kernel objects, such as pipes and
+// open files, so they needn't take a whole page each.
+//
+// Objects come in a few size classes. Each class carves
+// pages from kalloc() into slabs of equal-sized objects;
+// a slab's header sits at the start of its page, so
+// kmfree() finds it by rounding the address down. A
+// request bigger than the largest class gets a whole page,
+// which kmfree() recognizes by its alignment: slab objects
+// never start on a page boundary.
+//
+// As with kalloc(), each cpu caches a few free objects of
+// each class so that most calls don't take a class lock.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+struct run {
+  struct run *next;
+};
+
+struct slab {
+  struct slab *next;    // in its class's list of slabs with free objects
+  struct slab *prev;
+  struct run *freelist; // free objects in this slab
+  short class;
+  short nfree;
+};
+
+// sizes are chosen so that a page holds a whole number
+// of objects plus the slab header, with little waste.
+// a struct pipe fits the 576-byte class, seven to a page.
+static const short kmsizes[] = { 16, 32, 64, 128, 256, 384, 576, 1008, 2032 };
+#define NKMCLASS ((int)(sizeof(kmsizes) / sizeof(kmsizes[0])))
+#define KMMAX    2032
+
+#define KMCACHEMAX 16   // drain a batch when a cache grows to this
+#define KMBATCH    8    // objects moved per refill or drain
+
+struct kmclass {
+  struct spinlock lock;
+  struct slab *partial; // slabs with at least one free object
+  int size;
+  int nobj;             // objects per slab
+} kmclass[NKMCLASS];
+
+// only touched by its own cpu, with interrupts off,
+// so it needs no lock.
+struct kmcache {
+  struct run *freelist;
+  int n;
+} kmcache[NCPU][NKMCLASS];
+
+void
+kmallocinit(void)
+{
+  for(int i = 0; i < NKMCLASS; i++){
+    initlock(&kmclass[i].lock, "kmclass");
+    kmclass[i].size = kmsizes[i];
+    kmclass[i].nobj = (PGSIZE - sizeof(struct slab)) / kmsizes[i];
+  }
+}
+
+static int
+sizeclass(uint64 n)
+{
+  for(int i = 0; i < NKMCLASS; i++)
+    if(n <= kmsizes[i])
+      return i;
+  return -1;
+}
+
+static void
+slabunlink(struct kmclass *kc, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    kc->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->next = s->prev = 0;
+}
+
+static void
+slablink(struct kmclass *kc, struct slab *s)
+{
+  s->prev = 0;
+  s->next = kc->partial;
+  if(kc->partial)
+    kc->partial->prev = s;
+  kc->partial = s;
+}
+
+// make a new slab for class c out of a fresh page.
+static struct slab *
+slabnew(int c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->next = s->prev = 0;
+  s->freelist = 0;
+  s->class = c;
+  s->nfree = kmclass[c].nobj;
+  obj = (char*)s + PGSIZE - kmclass[c].nobj * kmclass[c].size;
+  for(int i = 0; i < kmclass[c].nobj; i++, obj += kmclass[c].size){
+    struct run *r = (struct run*)obj;
+    r->next = s->freelist;
+    s->freelist = r;
+  }
+  return s;
+}
+
+// take up to KMBATCH objects of class c from its slabs,
+// making a new slab if none has a free object.
+// returns a chain of them and sets *got.
+static struct run *
+refill(int c, int *got)
+{
+  struct kmclass *kc = &kmclass[c];
+  struct run *chain = 0, *r;
+  struct slab *s, *new = 0;
+
+  *got = 0;
+ again:
+  acquire(&kc->lock);
+  if(kc->partial == 0 && new){
+    slablink(kc, new);
+    new = 0;
+  }
+  while(*got < KMBATCH && (s = kc->partial) != 0){
+    r = s->freelist;
+    s->freelist = r->next;
+    r->next = chain;
+    chain = r;
+    (*got)++;
+    if(--s->nfree == 0)
+      slabunlink(kc, s);
+  }
+  release(&kc->lock);
+
+  if(*got == 0 && new == 0 && (new = slabnew(c)) != 0)
+    goto again;
+  if(new)
+    kfree(new); // raced with another cpu that made one
+  return chain;
+}
+
+// give the objects in chain back to their slabs, and
+// free the pages of slabs that become empty, except one
+// per class to avoid thrashing.
+static void
+drain(int c, struct run *chain)
+{
+  struct kmclass *kc = &kmclass[c];
+  struct run *r;
+  struct slab *s;
+
+  acquire(&kc->lock);
+  while((r = chain) != 0){
+    chain = r->next;
+    s = (struct slab*)PGROUNDDOWN((uint64)r);
+    r->next = s->freelist;
+    s->freelist = r;
+    if(s->nfree++ == 0)
+      slablink(kc, s);
+    if(s->nfree == kc->nobj && (s->next || s->prev)){
+      slabunlink(kc, s);
+      release(&kc->lock);
+      kfree(s);
+      acquire(&kc->lock);
+    }
+  }
+  release(&kc->lock);
+}
+
+// Allocate n bytes of kernel memory, at most a page.
+// Returns 0 if the memory cannot be allocated.
+// The contents are junk.
+void *
+kmalloc(uint64 n)
+{
+  struct kmcache *cc;
+  struct run *r;
+  int c, got;
+
+  if(n > KMMAX)
+    return n <= PGSIZE ? kalloc() : 0;
+  c = sizeclass(n);
+
+  push_off();
+  cc = &kmcache[cpuid()][c];
+  if(cc->freelist == 0){
+    r = refill(c, &got);
+    cc->freelist = r;
+    cc->n = got;
+  }
+  r = cc->freelist;
+  if(r){
+    cc->freelist = r->next;
+    cc->n--;
+  }
+  pop_off();
+  return (void*)r;
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *p)
+{
+  struct kmcache *cc;
+  struct slab *s;
+  struct run *r = (struct run*)p, *chain;
+  int c;
+
+  if(((uint64)p % PGSIZE) == 0){
+    kfree(p);
+    return;
+  }
+  s = (struct slab*)PGROUNDDOWN((uint64)p);
+  c = s->class;
+  if(c < 0 || c >= NKMCLASS || ((char*)s + PGSIZE - (char*)p) % kmsizes[c] != 0)
+    panic("kmfree");
+
+  push_off();
+  cc = &kmcache[cpuid()][c];
+  r->next = cc->freelist;
+  cc->freelist = r;
+  if(++cc->n >= KMCACHEMAX){
+    // cache is full; hand a batch back to the slabs.
+    struct run *tail = cc->freelist;
+    for(int i = 1; i < KMBATCH; i++)
+      tail = tail->next;
+    chain = cc->freelist;
+    cc->freelist = tail->next;
+    tail->next = 0;
+    cc->n -= KMBATCH;
+    drain(c, chain);
+  }
+  pop_off();
+}
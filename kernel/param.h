@@ -10,9 +10,13 @@
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define NVMA         16  // demand-paged memory regions per process
+#define MAXORDER     10  // largest kallocorder() block is 2^MAXORDER pages
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         (LOGSIZE*2+MAXOPBLOCKS)  // minimum size of disk block cache; see write_log()
+#define BCACHEFRAC    8  // disk block cache grows to at most 1/BCACHEFRAC of RAM
+#define MAXSEG       32  // max # of blocks in one disk request
 #ifdef LAB_FS
 #define FSSIZE       200000  // size of file system in blocks
 #else
@@ -23,6 +27,8 @@
 #endif
 #endif
 #define MAXPATH      128   // maximum file path name
+#define TICKCYCLES   1000000 // timer cycles per clock tick, about 1/10th second
+#define IDLETICKS    100   // longest an idle hart sleeps without a clock tick
 
 #ifdef LAB_UTIL
 #define USERSTACK    2     // user stack pages
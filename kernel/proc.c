@@ -5,11 +5,11 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "schedstat.h"
 
 struct cpu cpus[NCPU];
 struct proc proc[NPROC];
 struct proc *initproc;
-struct proc *idleproc;  // 空闲进程指针
 int nextpid = 1;
 struct spinlock pid_lock;
 
@@ -20,166 +20,394 @@ extern char trampoline[];
 // 等待锁
 struct spinlock wait_lock;
 
+// 睡眠进程按chan哈希到等待队列，wakeup()只需扫描一个桶
+#define WAITQ_SHIFT 6
+#define NWAITQ (1 << WAITQ_SHIFT)
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;          // 通过wait_next/wait_prev串起的睡眠进程
+};
+static struct waitq waitqs[NWAITQ];
+
+static struct waitq* chan_waitq(void *chan) {
+  return &waitqs[((uint64)chan * 0x9E3779B97F4A7C15UL) >> (64 - WAITQ_SHIFT)];
+}
+
 // MLFQ相关全局变量
-struct mlfq_queue mlfq_queues[NMLFQ];
+// 运行队列按CPU划分，见struct cpu中的rq
 int queue_time_slice[NMLFQ] = {1, 2, 4, 8, 16};
-struct spinlock mlfq_lock;
 
-// MLFQ初始化
+// MLFQ初始化：每个CPU一组队列
 void mlfq_init(void) {
-  initlock(&mlfq_lock, "mlfq");
-  for(int j = 0; j < NMLFQ; j++) {
-    mlfq_queues[j].front = 0;
-    mlfq_queues[j].rear = 0;
-    mlfq_queues[j].count = 0;
+  for(int i = 0; i < NCPU; i++) {
+    struct mlfq_rq *rq = &cpus[i].rq;
+    initlock(&rq->lock, "mlfq");
+    rq->nready = 0;
+    rq->ready = 0;
+    for(int j = 0; j < NMLFQ; j++) {
+      rq->queues[j].head = 0;
+      rq->queues[j].tail = 0;
+      rq->queues[j].count = 0;
+    }
+  }
+}
+
+// 返回x中最低的置位位序号（x不为0），用于在位图中找最高优先级的非空队列
+static int ffs_bit(uint32 x) {
+  static const char debruijn[32] = {
+    0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+    31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+  };
+  return debruijn[((x & -x) * 0x077CB531U) >> 27];
+}
+
+// 放入CPU id的第priority级队列尾部，调用者需持有该队列的锁
+static void rq_push(int id, int priority, struct proc* p) {
+  struct mlfq_rq *rq = &cpus[id].rq;
+  struct mlfq_queue* q = &rq->queues[priority];
+
+  p->rq_next = 0;
+  p->rq_prev = q->tail;
+  if(q->tail)
+    q->tail->rq_next = p;
+  else
+    q->head = p;
+  q->tail = p;
+  q->count++;
+  rq->nready++;
+  rq->ready |= 1U << priority;
+
+  p->rqcpu = id;
+  p->priority = priority;
+  p->ticks_in_queue = 0;
+  p->entry_time = ticks;
+  p->qstamp = r_time();
+}
+
+// 从所在队列中摘除进程，调用者需持有rq->lock
+static void rq_remove(struct mlfq_rq *rq, struct proc* p) {
+  struct mlfq_queue* q = &rq->queues[p->priority];
+
+  if(p->rq_prev)
+    p->rq_prev->rq_next = p->rq_next;
+  else
+    q->head = p->rq_next;
+  if(p->rq_next)
+    p->rq_next->rq_prev = p->rq_prev;
+  else
+    q->tail = p->rq_prev;
+  p->rq_next = 0;
+  p->rq_prev = 0;
+
+  q->count--;
+  rq->nready--;
+  if(q->count == 0)
+    rq->ready &= ~(1U << p->priority);
+  p->rqcpu = -1;
+  p->waittime += r_time() - p->qstamp;
+}
+
+// 取出第priority级队列的队首进程，调用者需持有rq->lock
+static struct proc* rq_pop(struct mlfq_rq *rq, int priority) {
+  struct proc* p = rq->queues[priority].head;
+
+  if(p)
+    rq_remove(rq, p);
+  return p;
+}
+
+// 取出最高优先级非空队列的队首进程，调用者需持有rq->lock
+static struct proc* rq_pop_highest(struct mlfq_rq *rq) {
+  if(rq->ready == 0)
+    return 0;
+  return rq_pop(rq, ffs_bit(rq->ready));
+}
+
+// 取出可以被窃取的最高优先级进程，调用者需持有rq->lock。
+// 跳过oncpu仍为1的进程：它刚被唤醒，还没在原CPU上切换出去，
+// 窃取者若在prepare_switch()里关中断等它，可能与原CPU互相等待而死锁。
+// 出队后oncpu不会再被置1（只有选中它的CPU会置），所以检查之后不会失效
+static struct proc* rq_pop_stealable(struct mlfq_rq *rq) {
+  struct proc *p;
+
+  for(int prio = 0; prio < NMLFQ; prio++) {
+    if((rq->ready & (1U << prio)) == 0)
+      continue;
+    for(p = rq->queues[prio].head; p != 0; p = p->rq_next) {
+      if(*(volatile int *)&p->oncpu == 0) {
+        rq_remove(rq, p);
+        return p;
+      }
+    }
+  }
+  return 0;
+}
+
+// 有进程进入CPU id的队列：id空闲（时钟可能已停）则发IPI叫醒它，
+// 否则叫醒任意一个空闲CPU来窃取，免得进程等到id的当前进程让出CPU
+static void mlfq_kick(int id) {
+  // 与scheduler()中先置idle再检查队列配对
+  __sync_synchronize();
+  if(cpus[id].idle) {
+    ipi_send(id);
+    return;
+  }
+  for(int i = 0; i < NCPU; i++) {
+    if(cpus[i].idle) {
+      ipi_send(i);
+      return;
+    }
   }
 }
 
-// 进程入队
+// 进程入队，放入它最近运行的CPU的队列
 void mlfq_enqueue(int priority, struct proc* p) {
   if(priority < 0) priority = 0;
   if(priority >= NMLFQ) priority = NMLFQ - 1;
-  
-  acquire(&mlfq_lock);
-  
-  // 检查进程状态，ZOMBIE进程不应该入队
-  if(p->state != RUNNABLE) {
-    release(&mlfq_lock);
+
+  int id = p->cpu;
+  struct mlfq_rq *rq = &cpus[id].rq;
+
+  acquire(&rq->lock);
+
+  // 检查进程状态，ZOMBIE进程不应该入队；已在队列中的进程不重复入队
+  if(p->state != RUNNABLE || p->rqcpu >= 0) {
+    release(&rq->lock);
     return;
   }
-  
-  struct mlfq_queue* q = &mlfq_queues[priority];
-  if(q->count < NPROC) {
-    q->procs[q->rear] = p;
-    q->rear = (q->rear + 1) % NPROC;
-    q->count++;
-    
-    p->priority = priority;
-    p->ticks_in_queue = 0;
-    p->entry_time = ticks;
+
+  rq_push(id, priority, p);
+
+  release(&rq->lock);
+
+  mlfq_kick(id);
+}
+
+// 从队列中移除进程
+void mlfq_remove(struct proc* p) {
+  if(p == 0) return;
+
+  int id = p->rqcpu;
+  if(id < 0)
+    return;
+
+  struct mlfq_rq *rq = &cpus[id].rq;
+  acquire(&rq->lock);
+  // 加锁前可能已被其他CPU窃取
+  if(p->rqcpu == id)
+    rq_remove(rq, p);
+  release(&rq->lock);
+}
+
+// 加上p->cpu所在队列的锁并返回该队列。
+// priority、ticks_in_queue和cpu都受这把锁保护：在队列中时rqcpu等于cpu，
+// cpu只在窃取时、持有原队列锁的情况下改变，所以加锁后要复查
+static struct mlfq_rq* mlfq_lock(struct proc *p) {
+  for(;;) {
+    int id = *(volatile int *)&p->cpu;
+    struct mlfq_rq *rq = &cpus[id].rq;
+    acquire(&rq->lock);
+    if(p->cpu == id)
+      return rq;
+    release(&rq->lock);
   }
-  
-  release(&mlfq_lock);
 }
 
-// 进程出队
-struct proc* mlfq_dequeue(int priority) {
-  acquire(&mlfq_lock);
-  
-  struct proc* p = 0;
-  struct mlfq_queue* q = &mlfq_queues[priority];
-  
-  if(q->count > 0) {
-    p = q->procs[q->front];
-    q->front = (q->front + 1) % NPROC;
-    q->count--;
+// 把进程调整到第priority级：在队列中则直接换到新队列尾部，
+// 不在队列中（正在运行或睡眠）则只修改级别，下次入队时生效
+void mlfq_move(struct proc* p, int priority) {
+  if(priority < 0) priority = 0;
+  if(priority >= NMLFQ) priority = NMLFQ - 1;
+
+  struct mlfq_rq *rq = mlfq_lock(p);
+  if(p->rqcpu >= 0) {
+    rq_remove(rq, p);
+    rq_push(p->cpu, priority, p);
+  } else {
+    p->priority = priority;
+    p->ticks_in_queue = 0;
   }
-  
-  release(&mlfq_lock);
-  return p;
+  release(&rq->lock);
 }
 
-// 从队列中移除进程
-void mlfq_remove(struct proc* p) {
-  if(p == 0 || p == idleproc) return;
-  
-  acquire(&mlfq_lock);
-  
-  struct mlfq_queue* q = &mlfq_queues[p->priority];
-  
-  // 线性搜索并移除
-  for(int i = 0; i < q->count; i++) {
-    int idx = (q->front + i) % NPROC;
-    if(q->procs[idx] == p) {
-      // 将后续元素前移
-      for(int j = i; j < q->count - 1; j++) {
-        int curr = (q->front + j) % NPROC;
-        int next = (q->front + j + 1) % NPROC;
-        q->procs[curr] = q->procs[next];
-      }
-      q->count--;
-      q->rear = (q->rear - 1 + NPROC) % NPROC;
-      break;
+// 时钟中断里给正在运行的进程p记一个时间片。
+// 时间片用完则降一级，返回1表示应让出CPU
+int mlfq_tick(struct proc *p) {
+  struct mlfq_rq *rq = mlfq_lock(p);
+  int expired = 0;
+
+  if(++p->ticks_in_queue >= queue_time_slice[p->priority]) {
+    if(p->priority < NMLFQ - 1) {
+      p->priority++;
+      p->ndemote++;
     }
+    p->ticks_in_queue = 0;
+    expired = 1;
   }
-  
-  release(&mlfq_lock);
+  release(&rq->lock);
+  return expired;
 }
 
-// 周期性提升优先级（防止饥饿）
+// 周期性提升本CPU队列中等待过久的进程（防止饥饿）
+// 每个CPU在自己的时钟中断里处理自己的队列
 void age_boost(void) {
-  acquire(&mlfq_lock);
-  
+  push_off();
+  int id = cpuid();
+  struct mlfq_rq *rq = &cpus[id].rq;
+
+  acquire(&rq->lock);
+
   for(int prio = NMLFQ - 1; prio > 0; prio--) {
-    struct mlfq_queue* q = &mlfq_queues[prio];
-    
-    // 收集需要提升的进程
-    struct proc* boost_list[NPROC];
-    int boost_count = 0;
-    
-    for(int i = 0; i < q->count && boost_count < NPROC; i++) {
-      int idx = (q->front + i) % NPROC;
-      struct proc* p = q->procs[idx];
-      if(ticks - p->entry_time > 200) {  // 长时间未运行
-        boost_list[boost_count++] = p;
+    struct proc *p, *nextp;
+
+    for(p = rq->queues[prio].head; p != 0; p = nextp) {
+      nextp = p->rq_next;
+      if(ticks - p->entry_time > 200) {  // 长时间未运行，提升一级
+        rq_remove(rq, p);
+        rq_push(id, prio - 1, p);
+        p->nboost++;
       }
     }
-    
-    // 提升收集到的进程
-    for(int i = 0; i < boost_count; i++) {
-      struct proc* p = boost_list[i];
-      mlfq_remove(p);
-      mlfq_enqueue(prio - 1, p);
+  }
+
+  release(&rq->lock);
+  pop_off();
+}
+
+// 本地队列为空时，从最忙的CPU的最高优先级非空队列中窃取一个进程
+static struct proc* mlfq_steal(int self) {
+  struct mlfq_rq *busiest = 0;
+  struct proc *p = 0;
+  int max = 0;
+
+  // 不加锁读取nready，只作负载估计
+  for(int i = 0; i < NCPU; i++) {
+    if(i == self)
+      continue;
+    if(cpus[i].rq.nready > max) {
+      max = cpus[i].rq.nready;
+      busiest = &cpus[i].rq;
     }
   }
-  
-  release(&mlfq_lock);
+  if(busiest == 0)
+    return 0;
+
+  acquire(&busiest->lock);
+  p = rq_pop_stealable(busiest);
+  if(p)
+    p->cpu = self;  // 持有原队列的锁时改cpu，见mlfq_lock()
+  release(&busiest->lock);
+
+  return p;
 }
 
-void schedule(void) {
-  struct proc *prev = myproc();  // 当前进程
-  struct proc *next = 0;
-  
-  // 关闭中断，保证原子性
-  push_off();
-  
-  // 只有在进程状态是RUNNING且不是空闲进程时才重新入队
-  // ZOMBIE进程不会被重新入队
-  if(prev && prev->state == RUNNING && prev != idleproc) {
+// 是否有CPU的队列里还有进程（不加锁，只作判断空闲前的复查）
+static int mlfq_any_ready(void) {
+  for(int i = 0; i < NCPU; i++)
+    if(*(volatile int *)&cpus[i].rq.nready > 0)
+      return 1;
+  return 0;
+}
+
+// 选出本CPU下一个要运行的进程，没有则返回0。
+// prev若仍为RUNNING则先放回本地队列，入队和选择共用一次加锁；
+// 按位图直接定位最高优先级的非空队列，不是RUNNABLE的过期表项直接丢弃
+static struct proc* mlfq_pick(int id, struct proc *prev) {
+  struct mlfq_rq *rq = &cpus[id].rq;
+  struct proc *next;
+
+  acquire(&rq->lock);
+  // ZOMBIE、SLEEPING进程不会被重新入队
+  if(prev && prev->state == RUNNING) {
     prev->state = RUNNABLE;
-    mlfq_enqueue(prev->priority, prev);
-  }
-  
-  // 选择下一个进程，跳过ZOMBIE状态
-    
-    for(int prio = 0; prio < NMLFQ; prio++) {
-      next = mlfq_dequeue(prio);
-      if(next != 0 && next->state == RUNNABLE) {
-        goto found;
-      }
-      // 如果进程状态不是RUNNABLE，放回队列（如果需要的话）
-      if(next != 0) {
-        mlfq_enqueue(next->priority, next);
-        next = 0;
-      }
-    
+    rq_push(id, prev->priority, prev);
   }
-  
-found:
-  // 如果没有进程可运行，使用空闲进程
+  while((next = rq_pop_highest(rq)) != 0 && next->state != RUNNABLE)
+    ;
+  release(&rq->lock);
+
+  // 本地队列为空，尝试从其他CPU窃取
   if(next == 0) {
-    next = idleproc;
+    next = mlfq_steal(id);
+    if(next != 0 && next->state != RUNNABLE)
+      next = 0;
   }
-  
-  // 设置下一个进程状态
+  return next;
+}
+
+// 准备在CPU id上切换到next。next可能刚在别的CPU上被切换出去，
+// 要等它的上下文保存完毕（oncpu清零）才能切换过去
+static void prepare_switch(struct proc *next, int id) {
+  while(*(volatile int *)&next->oncpu)
+    ;
+  __sync_synchronize();
+
   next->state = RUNNING;
+  next->oncpu = 1;
+  next->stamp = r_time();
   mycpu()->proc = next;
+}
+
+// swtch()返回后调用：上一个进程的上下文已经保存完毕，
+// 清除它的oncpu，允许其他CPU切换到它
+static void finish_switch(void) {
+  struct cpu *c = mycpu();
+  struct proc *from = c->from;
+
+  c->from = 0;
+  if(from)
+    __sync_lock_release(&from->oncpu);
+}
+
+void schedule(void) {
+  struct proc *prev = myproc();  // 当前进程
+  struct proc *next;
+  struct cpu *c;
+  int intena;
   
-  // 切换上下文
-  swtch(&prev->context, &next->context);
-  
-  // 切换回来后，更新CPU当前进程（可能已经改变）
-  mycpu()->proc = myproc();
+  // 关闭中断，保证原子性
+  push_off();
+
+  int id = cpuid();
+  c = mycpu();
+
+  // 不是RUNNING说明是睡眠或退出，属于主动让出CPU
+  int voluntary = prev->state != RUNNING;
+
+  // 结算运行时间。stamp只在切换路径上改写，睡眠窗口里被唤醒入队不影响它
+  prev->runtime += r_time() - prev->stamp;
+
+  next = mlfq_pick(id, prev);
+  if(next == prev) {
+    // 选中的仍是自己，不必切换
+    prev->state = RUNNING;
+    prev->stamp = r_time();
+    pop_off();
+    return;
+  }
+
+  if(voluntary)
+    prev->nvcsw++;
+  else
+    prev->nivcsw++;
+
+  // intena属于当前内核线程而不是CPU，跨swtch保存
+  intena = c->intena;
+  c->from = prev;
+
+  if(next) {
+    prepare_switch(next, id);
+    swtch(&prev->context, &next->context);
+  } else {
+    // 没有可运行的进程，回到本CPU的空闲上下文
+    c->proc = 0;
+    swtch(&prev->context, &c->context);
+  }
+
+  // 切换回来后可能已在另一个CPU上
+  finish_switch();
+  mycpu()->intena = intena;
   
   // 恢复中断
   pop_off();
@@ -204,6 +432,10 @@ void procinit(void) {
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NWAITQ; i++) {
+    initlock(&waitqs[i].lock, "waitq");
+    waitqs[i].head = 0;
+  }
   
   // 初始化所有进程
   for(p = proc; p < &proc[NPROC]; p++) {
@@ -213,24 +445,15 @@ void procinit(void) {
     p->priority = 0;
     p->ticks_in_queue = 0;
     p->entry_time = 0;
+    p->cpu = 0;
+    p->rqcpu = -1;
+    p->rq_next = 0;
+    p->rq_prev = 0;
+    p->oncpu = 0;
+    p->wait_next = 0;
+    p->wait_prev = 0;
   }
-  
-  // 初始化空闲进程（使用第一个进程槽位）
-  idleproc = &proc[0];
-  // 这里不需要锁，因为是在单核启动阶段
-  idleproc->state = RUNNABLE;
-  idleproc->pid = 0;
-  idleproc->priority = NMLFQ - 1;  // 最低优先级
-  safestrcpy(idleproc->name, "idle", sizeof(idleproc->name));
-  
-  // 初始化空闲进程的上下文
-  memset(&idleproc->context, 0, sizeof(idleproc->context));
-  idleproc->context.ra = (uint64)forkret;
-  idleproc->context.sp = idleproc->kstack + PGSIZE;
-  
-  // 空闲进程入队
-  mlfq_enqueue(idleproc->priority, idleproc);
-  
+
   mlfq_init();  // 初始化MLFQ队列
 }
 
@@ -273,8 +496,6 @@ static struct proc* allocproc(void) {
   struct proc *p;
 
   for(p = proc; p < &proc[NPROC]; p++) {
-    if(p == idleproc) continue;  // 跳过空闲进程
-    
     acquire(&p->lock);
     if(p->state == UNUSED) {
       goto found;
@@ -312,6 +533,13 @@ found:
   p->priority = 0;
   p->ticks_in_queue = 0;
   p->entry_time = ticks;
+  p->cpu = cpuid();  // 新进程先放在创建它的CPU上
+  p->rqcpu = -1;
+  p->asid = 0;       // 第一次返回用户态时分配
+  p->tlbcpu = -1;
+  p->runtime = p->waittime = 0;
+  p->ndemote = p->nboost = 0;
+  p->nvcsw = p->nivcsw = 0;
   
   return p;
 }
@@ -385,6 +613,7 @@ void userinit(void) {
 
   p = allocproc();
   initproc = p;
+  p->depth = 0;
   
   // 分配用户页并复制initcode
   uvmfirst(p->pagetable, initcode, sizeof(initcode));
@@ -409,10 +638,15 @@ int growproc(int n) {
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // 堆懒分配：只扩大sz，页面在第一次访问时由vmfault()分配
+    // 堆不能长进mmap区域
+    if(sz + n >= TRAPFRAME || vmaoverlap(p, PGROUNDUP(sz), sz + n))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
+    // 新的堆顶落在大页中间时先把大页拆开
+    if(uvmsplit(p->pagetable, PGROUNDUP(sz + n)) < 0)
+      return -1;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
@@ -438,6 +672,13 @@ int fork(void) {
   }
   np->sz = p->sz;
 
+  // mmap区域的页面也要共享给子进程
+  if(vmacopy(p->pagetable, np->pagetable, p->vma) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   // 复制保存的用户寄存器
   *(np->trapframe) = *(p->trapframe);
 
@@ -449,10 +690,12 @@ int fork(void) {
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  vmadup(np->vma, p->vma);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   // 复制MLFQ字段
+  np->depth = p->depth + 1;
   np->priority = p->priority;
   np->ticks_in_queue = 0;
   np->entry_time = ticks;
@@ -482,42 +725,7 @@ void reparent(struct proc *p) {
     }
   }
 }
-/*
-static void exit_schedule(void) {
-  struct proc *p = myproc();  // 当前进程，应该是ZOMBIE状态
-  struct proc *next = 0;
-  
-  // 关闭中断，保证原子性
-  push_off();
-  
-  // 选择下一个进程
-  for(int prio = 0; prio < NMLFQ; prio++) {
-    next = mlfq_dequeue(prio);
-    if(next != 0) {
-      break;
-    }
-  }
-  
-  // 如果没有进程可运行，使用空闲进程
-  if(next == 0) {
-    next = idleproc;
-  }
-  
-  // 设置下一个进程状态
-  next->state = RUNNING;
-  mycpu()->proc = next;
-  
-  // 切换上下文
-  swtch(&p->context, &next->context);
-  
-  // 如果切换回来（不应该发生），进入死循环
-  mycpu()->proc = myproc();
-  pop_off();
-  
-  // 不应该执行到这里
-  panic("zombie process scheduled again");
-}
-*/
+
 // 退出当前进程 - 最终版本
 void exit(int status) {
   struct proc *p = myproc();
@@ -537,6 +745,9 @@ void exit(int status) {
     }
   }
 
+  // 写回并解除mmap映射，释放各区域引用的文件
+  vmaput(p->pagetable, p->vma);
+
   begin_op();
   iput(p->cwd);
   end_op();
@@ -571,6 +782,9 @@ int wait(uint64 addr) {
   int havekids, pid;
   struct proc *p = myproc();
 
+  // copyout下面在持有自旋锁时进行，不能在那里睡眠读盘
+  if(addr != 0)
+    uvmprefault(p->pagetable, addr, sizeof(int), 1);
   acquire(&wait_lock);
 
   for(;;){
@@ -582,6 +796,9 @@ int wait(uint64 addr) {
         havekids = 1;
         if(pp->state == ZOMBIE){
           // 找到一个
+          // 等它在原CPU上彻底切换出去，之后才能释放它的内核栈和页表
+          while(*(volatile int *)&pp->oncpu)
+            ;
           pid = pp->pid;
           if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
                                   sizeof(pp->xstate)) < 0) {
@@ -609,23 +826,52 @@ int wait(uint64 addr) {
   }
 }
 
-// 调度器 - 简化版本
+// 调度器 - 每个CPU的空闲循环
+// 运行在该CPU自己的启动栈上，上下文保存在cpu->context中，
+// schedule()找不到可运行进程时切换回这里
 void scheduler(void) {
   struct cpu *c = mycpu();
+  int id = cpuid();
+  struct proc *next;
   
-  // 设置当前CPU的进程为空闲进程
-  c->proc = idleproc;
+  c->proc = 0;
   
-  // 空闲进程循环
   for(;;) {
-    // 确保空闲进程在队列中
-    if(idleproc->state != RUNNABLE) {
-      idleproc->state = RUNNABLE;
-    }
-    
-    // 在空闲进程中循环
+    // 打开中断，让设备中断有机会唤醒进程
     intr_on();
-    asm volatile("wfi");  // 等待中断，节省功耗
+
+    push_off();
+    next = mlfq_pick(id, 0);
+    if(next) {
+      c->from = 0;
+      prepare_switch(next, id);
+      swtch(&c->context, &next->context);
+      finish_switch();
+      c->proc = 0;
+    }
+    pop_off();
+
+    if(next == 0) {
+      // 先为kzalloc()预清零一页；每清一页都回头重新检查运行队列
+      if(kzerofill())
+        continue;
+      // 本CPU无事可做：标记空闲后再确认一次没有可运行或可窃取的进程，
+      // 之后入队的一方会看到idle并发IPI，不会错过。
+      // 从置idle到wfi一直关着中断：复查之后到达的IPI（包括clockarm()
+      // 发给0号CPU的）保持挂起，wfi照样被它唤醒，而不会在wfi之前
+      // 就被处理掉、让本CPU一直睡到IDLETICKS之后
+      intr_off();
+      c->idle = 1;
+      __sync_synchronize();
+      if(!mlfq_any_ready()) {
+        // 停掉周期时钟，等待中断，节省功耗
+        clockidle();
+        asm volatile("wfi");
+        clockbusy();
+      }
+      c->idle = 0;
+      // 回到循环开头intr_on()，处理唤醒本CPU的中断
+    }
   }
 }
 
@@ -648,43 +894,18 @@ void sched(void) {
 
 // 放弃CPU
 void yield(void) {
-  struct proc *p = myproc();
-  
-  // 如果进程是ZOMBIE状态，不要重新入队
-  if(p->state == ZOMBIE) {
-    // 直接触发调度，但不会重新入队
-    push_off();
-    
-    struct proc *next = 0;
-    for(int prio = 0; prio < NMLFQ; prio++) {
-      next = mlfq_dequeue(prio);
-      if(next != 0) {
-        break;
-      }
-    }
-    
-    if(next == 0) {
-      next = idleproc;
-    }
-    
-    next->state = RUNNING;
-    mycpu()->proc = next;
-    
-    swtch(&p->context, &next->context);
-    
-    mycpu()->proc = myproc();
-    pop_off();
-  } else {
-    // 正常进程调用schedule
-    schedule();
-  }
+  // schedule()只把RUNNING状态的进程重新入队，
+  // ZOMBIE进程在这里让出CPU后不会再被调度
+  schedule();
 }
 
 // fork返回
 void forkret(void) {
   static int first = 1;
 
-  // 注意：我们不释放锁，因为锁没有被持有
+  // 从schedule()或scheduler()切换过来，完成切换并恢复push_off()
+  finish_switch();
+  pop_off();
 
   if (first) {
     // 文件系统初始化必须在常规进程的上下文中运行
@@ -696,42 +917,68 @@ void forkret(void) {
   usertrapret();
 }
 
+// 把睡眠进程挂到chan所在的哈希桶，调用者需持有wq->lock
+static void waitq_add(struct waitq *wq, struct proc *p) {
+  p->wait_prev = 0;
+  p->wait_next = wq->head;
+  if(wq->head)
+    wq->head->wait_prev = p;
+  wq->head = p;
+}
+
+// 从哈希桶中摘除进程，调用者需持有wq->lock
+static void waitq_del(struct waitq *wq, struct proc *p) {
+  if(p->wait_prev)
+    p->wait_prev->wait_next = p->wait_next;
+  else
+    wq->head = p->wait_next;
+  if(p->wait_next)
+    p->wait_next->wait_prev = p->wait_prev;
+  p->wait_next = 0;
+  p->wait_prev = 0;
+}
+
 // 睡眠
 void sleep(void *chan, struct spinlock *lk) {
   struct proc *p = myproc();
-  //acquire(&p->lock);
-  // 释放调用者传递的锁
+  struct waitq *wq = chan_waitq(chan);
+
+  // 先拿到chan所在哈希桶的锁再释放调用者传递的锁，
+  // wakeup()也要拿这把锁，因此不会丢失唤醒
+  acquire(&wq->lock);
   release(lk);
   
   // 设置睡眠状态
   p->chan = chan;
   p->state = SLEEPING;
+  waitq_add(wq, p);
+  release(&wq->lock);
   
   // 调用调度函数
   schedule();
   
   // 当被唤醒后，继续执行到这里
-  // 清理状态
-  p->chan = 0;
-  //release(&p->lock);
   // 重新获取调用者传递的锁
   acquire(lk);
 }
 
-// 唤醒
+// 唤醒chan上的所有进程，只扫描chan所在的哈希桶
 void wakeup(void *chan) {
-  struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc() && p != idleproc){
-      // 原子比较和交换的方式来避免锁
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-        // 唤醒的进程放入最高优先级（I/O密集型）
-        mlfq_enqueue(0, p);
-      }
+  struct waitq *wq = chan_waitq(chan);
+  struct proc *p, *nextp;
+
+  acquire(&wq->lock);
+  for(p = wq->head; p != 0; p = nextp) {
+    nextp = p->wait_next;
+    if(p->state == SLEEPING && p->chan == chan) {
+      waitq_del(wq, p);
+      p->chan = 0;
+      p->state = RUNNABLE;
+      // 唤醒的进程放入最高优先级（I/O密集型）
+      mlfq_enqueue(0, p);
     }
   }
+  release(&wq->lock);
 }
 
 // 杀死进程
@@ -739,15 +986,21 @@ int kill(int pid) {
   struct proc *p;
 
   for(p = proc; p < &proc[NPROC]; p++){
-    if(p == idleproc) continue;
     acquire(&p->lock);
     
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        p->state = RUNNABLE;
-        mlfq_enqueue(p->priority, p);
-    
+      void *chan = p->chan;
+      if(chan){
+        struct waitq *wq = chan_waitq(chan);
+        acquire(&wq->lock);
+        if(p->state == SLEEPING && p->chan == chan){
+          waitq_del(wq, p);
+          p->chan = 0;
+          p->state = RUNNABLE;
+          mlfq_enqueue(p->priority, p);
+        }
+        release(&wq->lock);
       }
       release(&p->lock);
       return 0;
@@ -757,6 +1010,85 @@ int kill(int pid) {
   return -1;
 }
 
+// 读取进程的调度统计，pid为0表示当前进程
+int getsched(int pid, struct schedstat *st) {
+  struct proc *p;
+
+  if(pid == 0)
+    pid = myproc()->pid;
+
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      st->pid = p->pid;
+      st->level = p->priority;
+      st->slice = queue_time_slice[p->priority];
+      st->ticks = p->ticks_in_queue;
+      st->runtime = p->runtime;
+      st->waittime = p->waittime;
+      // 正在运行或正在排队的这一段也算进去
+      if(p->state == RUNNING)
+        st->runtime += r_time() - p->stamp;
+      else if(p->rqcpu >= 0)
+        st->waittime += r_time() - p->qstamp;
+      st->ndemote = p->ndemote;
+      st->nboost = p->nboost;
+      st->nvcsw = p->nvcsw;
+      st->nivcsw = p->nivcsw;
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// p是否为当前进程或其后代，调用者持有wait_lock
+static int is_descendant(struct proc *p) {
+  struct proc *me = myproc();
+  for(; p; p = p->parent)
+    if(p == me)
+      return 1;
+  return 0;
+}
+
+// 调整调度参数
+// xv6没有用户身份，"特权"定义为：级别只能调整自己或自己的后代；
+// 时间片是全局参数，只允许init、shell以及从shell直接启动的命令修改
+// （即fork时距init不超过两层），被这些命令再fork出的进程不行。
+// 层数在fork时记下，父进程退出后被重新分配给init也不会变小
+int setsched(int op, int arg1, int arg2) {
+  struct proc *p;
+
+  switch(op){
+  case SCHED_LEVEL:
+    if(arg2 < 0 || arg2 >= NMLFQ)
+      return -1;
+    acquire(&wait_lock);
+    for(p = proc; p < &proc[NPROC]; p++){
+      if(p->pid != arg1 || p->state == UNUSED || p->state == ZOMBIE)
+        continue;
+      if(!is_descendant(p))
+        break;
+      mlfq_move(p, arg2);
+      release(&wait_lock);
+      return 0;
+    }
+    release(&wait_lock);
+    return -1;
+
+  case SCHED_SLICE:
+    if(arg1 < 0 || arg1 >= NMLFQ || arg2 < 1 || arg2 > 1000)
+      return -1;
+    if(myproc()->depth > 2)
+      return -1;
+    queue_time_slice[arg1] = arg2;
+    __sync_synchronize();
+    return 0;
+  }
+  return -1;
+}
+
 // 设置进程为已杀死
 void setkilled(struct proc *p) {
   acquire(&p->lock);
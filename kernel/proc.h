@@ -1,14 +1,24 @@
 #define NMLFQ 5               // 5级优先级队列
 #define MAXPRIO (NMLFQ - 1)   // 最高优先级为0，最低为4
+#if NMLFQ > 32
+#error "NMLFQ must fit in the 32-bit ready bitmap"
+#endif
 
-// MLFQ队列结构
+// MLFQ队列结构：进程通过struct proc中的rq_next/rq_prev串成双向链表
 struct mlfq_queue {
-  struct proc* procs[NPROC];  // 进程指针数组
-  int front;                  // 队列头
-  int rear;                   // 队列尾
+  struct proc* head;          // 队列头
+  struct proc* tail;          // 队列尾
   int count;                  // 队列中进程数量
 };
 
+// 每个CPU私有的一组MLFQ队列
+struct mlfq_rq {
+  struct spinlock lock;       // 保护本组队列
+  struct mlfq_queue queues[NMLFQ];
+  int nready;                 // 各级队列中进程总数，窃取时用来比较负载
+  uint32 ready;               // 非空队列位图，第i位对应第i级队列
+};
+
 // Saved registers for kernel context switches.
 struct context {
   uint64 ra;
@@ -32,9 +42,14 @@ struct context {
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
-  struct context context;     // swtch() here to enter scheduler().
+  struct context context;     // swtch() here to enter scheduler(), the idle loop.
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  struct mlfq_rq rq;          // 本CPU的MLFQ运行队列
+  struct proc *from;          // 刚在本CPU上被切换出去的进程，见finish_switch()
+  int idle;                   // 正在scheduler()中等待（时钟可能已停），入队时需IPI唤醒
+  uint64 asidgen;             // ASID generation this hart's TLB was last flushed for
+  uint lastboost;             // 本CPU上次做老化提升时的ticks，见clockintr()
 };
 
 extern struct cpu cpus[NCPU];
@@ -92,6 +107,22 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of user memory whose pages are read in from a
+// file on first access, see vmfault(). Bytes past filesz
+// are zero, and a region without a file is all zero.
+// Exec'd program segments lie below p->sz and have
+// flags 0; mmap() regions lie above it. A slot with
+// end == 0 is unused.
+struct vma {
+  uint64 start;                // Page-aligned first address
+  uint64 end;                  // One past the last page
+  int perm;                    // PTE flags for its pages
+  int flags;                   // MAP_SHARED or MAP_PRIVATE for mmap()
+  struct inode *ip;            // Backing file, or 0
+  uint off;                    // File offset of start
+  uint filesz;                 // Bytes of file data from start
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -115,18 +146,39 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  struct vma vma[NVMA];        // Demand-paged regions, see vmfault()
+  uint64 asid;                 // Generation and TLB tag, see uvmasid()
+  int tlbcpu;                  // Hart that last ran it in user space
   int priority;           // 当前优先级 (0最高, 4最低)
   int ticks_in_queue;     // 在当前队列中运行的时间片数
   uint64 entry_time;      // 进入当前队列的时间
+  int cpu;                // 最近运行所在的CPU，入队时放入该CPU的队列
+  int rqcpu;              // 所在运行队列的CPU编号，-1表示不在队列中
+  struct proc *rq_next;   // MLFQ队列链表指针，受所在队列的锁保护
+  struct proc *rq_prev;
+  int oncpu;              // 上下文还在某个CPU上（运行中或正在切换出去）
+  struct proc *wait_next; // 睡眠等待队列链表指针，受chan所在哈希桶的锁保护
+  struct proc *wait_prev;
+  int depth;              // fork时在进程树中距init的层数，之后不再改变，见setsched()
+
+  // 调度统计，见schedstat.h
+  uint64 stamp;           // 最近一次开始运行的时刻(r_time)，只在切换路径上改写
+  uint64 qstamp;          // 最近一次入队的时刻，受所在队列的锁保护
+  uint64 runtime;         // 累计运行时间
+  uint64 waittime;        // 累计在队列中等待的时间
+  uint ndemote;           // 降级次数
+  uint nboost;            // 老化提升次数
+  uint nvcsw;             // 主动切换次数
+  uint nivcsw;            // 被动切换次数
 };
 // 声明全局变量
-extern struct mlfq_queue mlfq_queues[NMLFQ];
 extern int queue_time_slice[NMLFQ];
-extern struct spinlock mlfq_lock;
 
 // 函数声明
 void mlfq_init(void);
 void mlfq_remove(struct proc* p);
+void mlfq_move(struct proc* p, int priority);
+int mlfq_tick(struct proc *p);
 void age_boost(void);
 // 新增：调度函数声明
 void schedule(void);
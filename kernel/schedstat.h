@@ -0,0 +1,18 @@
+// MLFQ调度统计，getsched()返回给用户态
+// 时间单位为time CSR的计数（与rdtime相同，qemu上为10MHz）
+struct schedstat {
+  int pid;
+  int level;          // 当前优先级 (0最高)
+  int slice;          // 当前级别的时间片（时钟中断数）
+  int ticks;          // 当前时间片已用的时钟中断数
+  uint64 runtime;     // 累计运行时间
+  uint64 waittime;    // 累计在运行队列中等待的时间
+  uint ndemote;       // 时间片用完被降级的次数
+  uint nboost;        // 被老化机制提升的次数
+  uint nvcsw;         // 主动让出CPU次数（睡眠、退出）
+  uint nivcsw;        // 被抢占次数（时间片用完、时钟中断）
+};
+
+// setsched()的操作
+#define SCHED_LEVEL  1  // setsched(SCHED_LEVEL, pid, level)：调整进程级别
+#define SCHED_SLICE  2  // setsched(SCHED_SLICE, level, ticks)：调整某级时间片
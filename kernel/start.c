@@ -10,6 +10,12 @@ void timerinit();
 // entry.S needs one stack per CPU.
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
+// a scratch area per CPU for machine-mode IPI handling.
+uint64 ipi_scratch[NCPU][2];
+
+// assembly code in kernelvec.S for machine-mode IPIs.
+extern void ipivec();
+
 // entry.S jumps here in machine mode on stack0.
 void
 start()
@@ -60,7 +66,19 @@ timerinit()
   
   // allow supervisor to use stimecmp and time.
   w_mcounteren(r_mcounteren() | 2);
+
+  // let user programs read time too, for rdtime in schedbench.
+  w_scounteren(r_scounteren() | 2);
   
   // ask for the very first timer interrupt.
-  w_stimecmp(r_time() + 1000000);
+  w_stimecmp(r_time() + TICKCYCLES);
+
+  // other harts wake an idle hart by writing its CLINT msip;
+  // ipivec forwards that to supervisor mode as a software interrupt.
+  // scratch[1] holds this hart's msip address for ipivec.
+  int id = r_mhartid();
+  ipi_scratch[id][1] = CLINT_MSIP(id);
+  w_mscratch((uint64)&ipi_scratch[id][0]);
+  w_mtvec((uint64)ipivec);
+  w_mie(r_mie() | MIE_MSIE);
 }
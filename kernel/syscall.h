@@ -20,3 +20,7 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_getsched 22
+#define SYS_setsched 23
+#define SYS_mmap   24
+#define SYS_munmap 25
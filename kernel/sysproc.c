@@ -5,6 +5,8 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "timer.h"
+#include "schedstat.h"
 
 uint64
 sys_exit(void)
@@ -52,19 +54,22 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
+  struct timer t;
 
   argint(0, &n);
   if(n < 0)
     n = 0;
+  clockupdate();
   acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
+  // sleep on our own timer, so that only its expiry wakes us.
+  timer_add(&t, ticks + n);
+  while(!t.fired){
     if(killed(myproc())){
+      timer_del(&t);
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    sleep(&t, &tickslock);
   }
   release(&tickslock);
   return 0;
@@ -86,8 +91,38 @@ sys_uptime(void)
 {
   uint xticks;
 
+  clockupdate();
   acquire(&tickslock);
   xticks = ticks;
   release(&tickslock);
   return xticks;
 }
+
+// getsched(pid, struct schedstat *st)
+uint64
+sys_getsched(void)
+{
+  int pid;
+  uint64 addr;
+  struct schedstat st;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  if(getsched(pid, &st) < 0)
+    return -1;
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// setsched(op, arg1, arg2)
+uint64
+sys_setsched(void)
+{
+  int op, a1, a2;
+
+  argint(0, &op);
+  argint(1, &a1);
+  argint(2, &a2);
+  return setsched(op, a1, a2);
+}
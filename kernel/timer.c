@@ -0,0 +1,128 @@
+// Kernel timers.
+//
+// A hashed timing wheel: a timer that expires at tick t lives in
+// slot t % NTIMERSLOT.  clockintr() advances ticks and then looks
+// only at the slot for the new tick, so a timer is examined about
+// once every NTIMERSLOT ticks and fires exactly once, at its deadline,
+// instead of every sleeper being woken on every tick.
+//
+// Interface:
+// * timer_add() arms a timer; when it expires, timer_run() sets
+//   t->fired and calls wakeup(t).
+// * timer_del() disarms a timer that has not fired yet.
+// * timer_next() reports the earliest deadline, for tickless idle.
+// All timer state is protected by tickslock.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "timer.h"
+
+#define NTIMERSLOT 64
+
+static struct timer *wheel[NTIMERSLOT];
+static int ntimer;  // armed timers, for timer_next()
+
+// Arm t to fire at tick expires.
+// A deadline that has already passed fires immediately.
+void
+timer_add(struct timer *t, uint expires)
+{
+  struct timer **slot;
+
+  if(!holding(&tickslock))
+    panic("timer_add");
+
+  t->expires = expires;
+  t->fired = 0;
+  t->next = 0;
+  t->prev = 0;
+  if((int)(expires - ticks) <= 0){
+    t->fired = 1;
+    return;
+  }
+
+  slot = &wheel[expires % NTIMERSLOT];
+  t->next = *slot;
+  if(*slot)
+    (*slot)->prev = t;
+  *slot = t;
+  ntimer++;
+
+  // an idle hart 0 may need to wake up earlier for this one.
+  clockarm(expires);
+}
+
+// Disarm t if it has not fired yet.
+void
+timer_del(struct timer *t)
+{
+  if(!holding(&tickslock))
+    panic("timer_del");
+
+  if(t->fired)
+    return;
+  if(t->prev)
+    t->prev->next = t->next;
+  else
+    wheel[t->expires % NTIMERSLOT] = t->next;
+  if(t->next)
+    t->next->prev = t->prev;
+  t->next = 0;
+  t->prev = 0;
+  t->fired = 1;
+  ntimer--;
+}
+
+// Find the earliest expiry among armed timers.
+// Returns 0 if there are none.
+// Used by clockidle() to decide how long an idle hart may sleep.
+int
+timer_next(uint *expires)
+{
+  struct timer *t;
+  int found = 0;
+
+  if(!holding(&tickslock))
+    panic("timer_next");
+
+  if(ntimer == 0)
+    return 0;
+  for(int i = 0; i < NTIMERSLOT; i++){
+    for(t = wheel[i]; t != 0; t = t->next){
+      if(!found || (int)(t->expires - *expires) < 0)
+        *expires = t->expires;
+      found = 1;
+    }
+  }
+  return found;
+}
+
+// Fire the timers that expire at the current tick.
+// Called by clockintr() with tickslock held, once per tick.
+void
+timer_run(void)
+{
+  struct timer *t, *next;
+  struct timer **slot;
+
+  slot = &wheel[ticks % NTIMERSLOT];
+  for(t = *slot; t != 0; t = next){
+    next = t->next;
+    if((int)(t->expires - ticks) > 0)
+      continue;  // a later lap of the wheel
+    if(t->prev)
+      t->prev->next = t->next;
+    else
+      *slot = t->next;
+    if(t->next)
+      t->next->prev = t->prev;
+    t->next = 0;
+    t->prev = 0;
+    t->fired = 1;
+    ntimer--;
+    wakeup(t);
+  }
+}
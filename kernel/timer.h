@@ -0,0 +1,7 @@
+// Kernel timer, fires once when ticks reaches expires.
+struct timer {
+  uint expires;        // tick at which the timer fires
+  int fired;           // set by timer_run() once expired
+  struct timer *next;  // timer wheel slot list
+  struct timer *prev;
+};
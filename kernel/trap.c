@@ -8,6 +8,8 @@
 
 struct spinlock tickslock;
 uint ticks;
+static uint64 nexttick;   // r_time() at which ticks next advances
+static uint idlewatch;    // tick idle hart 0 will wake at, 0 if ticking
 
 extern char trampoline[], uservec[], userret[];
 
@@ -16,8 +18,7 @@ void kernelvec();
 
 extern int devintr();
 // 声明MLFQ函数
-void mlfq_enqueue(int priority, struct proc* p);
-void mlfq_remove(struct proc* p);
+int mlfq_tick(struct proc* p);
 void age_boost(void);
 
 // 声明MLFQ变量
@@ -27,6 +28,7 @@ void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  nexttick = r_time() + TICKCYCLES;
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -74,6 +76,9 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p->pagetable, r_stval(), r_scause() == 15) == 0){
+    // page fault on a demand-paged or copy-on-write page.
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -87,31 +92,12 @@ usertrap(void)
   if(which_dev == 2) {
       // 时钟中断 - MLFQ处理
       if(p != 0 && p->state == RUNNING) {
-        p->ticks_in_queue++;
-        
-        // 检查时间片是否用完
-        int time_slice = queue_time_slice[p->priority];
-        if(p->ticks_in_queue >= time_slice) {
-          // 时间片用完，降低优先级
-          int new_priority = p->priority + 1;
-          if(new_priority >= NMLFQ) {
-            new_priority = NMLFQ - 1;
-          }
-          
-          // 重新入队到更低优先级
-          mlfq_remove(p);
-          mlfq_enqueue(new_priority, p);
-          
+        // 时间片用完则降到更低一级，让出CPU时按新级别入队
+        if(mlfq_tick(p)) {
           // 让出CPU
           yield();
         }
       }
-      
-      // 周期性提升优先级（防止饥饿）
-      if(ticks % 100 == 0) {
-        age_boost();
-      }
-    
   } 
 
   usertrapret();
@@ -153,8 +139,9 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // tagged with the process's ASID.
+  uint64 satp = MAKE_SATP(p->pagetable) | SATP_ASID(uvmasid(p));
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -194,20 +181,101 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// bring ticks up to date with the real time, firing
+// timers that expire along the way. idle harts stop taking
+// clock interrupts, so ticks is advanced by whichever harts
+// are still ticking rather than by hart 0 alone.
+void
+clockupdate(void)
+{
+  if(r_time() < nexttick)
+    return;
+
+  acquire(&tickslock);
+  while(r_time() >= nexttick){
+    ticks++;
+    timer_run();
+    nexttick += TICKCYCLES;
+  }
+  release(&tickslock);
+}
+
 void
 clockintr()
 {
+  clockupdate();
+
+  // 周期性提升本CPU队列中进程的优先级（防止饥饿）。
+  // 按本CPU上次提升以来经过的ticks判断：ticks可能一次前进好几个，
+  // 本CPU也不一定恰好在100的倍数上收到时钟中断
+  struct cpu *c = mycpu();
+  if(ticks - c->lastboost >= 100) {
+    c->lastboost = ticks;
+    age_boost();
+  }
+
+  // ask for the next timer interrupt. this also clears
+  // the interrupt request.
+  w_stimecmp(r_time() + TICKCYCLES);
+}
+
+// called by a hart with nothing to run, just before wfi:
+// stop the periodic tick. hart 0 stays responsible for
+// timers and wakes at the earliest pending deadline; the
+// other harts sleep until an interrupt or ipi_send().
+void
+clockidle(void)
+{
+  uint64 when = r_time() + IDLETICKS*TICKCYCLES;
+  uint expires;
+
   if(cpuid() == 0){
     acquire(&tickslock);
-    ticks++;
-    wakeup(&ticks);
+    if(timer_next(&expires)){
+      uint64 deadline = nexttick + (uint64)(expires - ticks - 1) * TICKCYCLES;
+      if(deadline < when)
+        when = deadline;
+    }
+    idlewatch = ticks + (when - nexttick) / TICKCYCLES + 1;
     release(&tickslock);
   }
 
-  // ask for the next timer interrupt. this also clears
-  // the interrupt request. 1000000 is about a tenth
-  // of a second.
-  w_stimecmp(r_time() + 1000000);
+  w_stimecmp(when);
+}
+
+// called when an idle hart finds work again:
+// restart the periodic tick.
+void
+clockbusy(void)
+{
+  if(cpuid() == 0){
+    acquire(&tickslock);
+    idlewatch = 0;
+    release(&tickslock);
+  }
+
+  if(r_stimecmp() > r_time() + TICKCYCLES)
+    w_stimecmp(r_time() + TICKCYCLES);
+}
+
+// a timer expiring at expires was just armed. if idle
+// hart 0 would sleep past it, wake it to re-arm its clock.
+// caller holds tickslock.
+void
+clockarm(uint expires)
+{
+  if(idlewatch != 0 && (int)(expires - idlewatch) < 0){
+    idlewatch = 0;
+    ipi_send(0);
+  }
+}
+
+// interrupt another hart, e.g. to wake it from wfi.
+// it arrives there as a supervisor software interrupt.
+void
+ipi_send(int hartid)
+{
+  *(volatile uint32 *)CLINT_MSIP(hartid) = 1;
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -245,6 +313,11 @@ devintr()
     // timer interrupt.
     clockintr();
     return 2;
+  } else if(scause == 0x8000000000000001L){
+    // software interrupt from ipi_send(), only meant
+    // to get an idle hart out of wfi.
+    w_sip(r_sip() & ~SIP_SSIP);
+    return 1;
   } else {
     return 0;
   }
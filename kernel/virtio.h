@@ -45,9 +45,10 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
+// at most this many virtio descriptors; fewer if the
+// device's queue is shorter (see virtio_disk_init()).
 // must be a power of two.
-#define NUM 8
+#define NUM 256
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -39,8 +39,11 @@ static struct disk {
   struct virtq_used *used;
 
   // our own book-keeping.
+  uint32 num;      // descriptors in the queue, at most NUM.
+  int maxseg;      // blocks in the largest request that fits.
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  int nfree;
+  uint16 used_idx; // we've looked this far in used[2..num].
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
@@ -48,6 +51,7 @@ static struct disk {
   struct {
     struct buf *b;
     char status;
+    char async;  // started by virtio_disk_start(); no one waits
   } info[NUM];
 
   // disk command headers.
@@ -114,8 +118,12 @@ virtio_disk_init(void)
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
+  // the largest request must fit, or its submitter would
+  // wait forever for descriptors; see virtio_disk_submit().
+  if(max < 3)
+    panic("virtio disk queue too short");
+  disk.num = max < NUM ? max : NUM;
+  disk.maxseg = disk.num - 2 < MAXSEG ? disk.num - 2 : MAXSEG;
 
   // allocate and zero queue memory.
   disk.desc = kalloc();
@@ -128,7 +136,7 @@ virtio_disk_init(void)
   memset(disk.used, 0, PGSIZE);
 
   // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.num;
 
   // write physical addresses.
   *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
@@ -141,9 +149,10 @@ virtio_disk_init(void)
   // queue is ready.
   *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
+  // all descriptors start out unused.
+  for(int i = 0; i < disk.num; i++)
     disk.free[i] = 1;
+  disk.nfree = disk.num;
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -156,9 +165,10 @@ virtio_disk_init(void)
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
+  for(int i = 0; i < disk.num; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
+      disk.nfree--;
       return i;
     }
   }
@@ -169,7 +179,7 @@ alloc_desc()
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.num)
     panic("free_desc 1");
   if(disk.free[i])
     panic("free_desc 2");
@@ -178,10 +188,11 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  disk.nfree++;
 }
 
 // free a chain of descriptors.
+// the caller wakes up anyone waiting for some.
 static void
 free_chain(int i)
 {
@@ -196,12 +207,13 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  if(disk.nfree < n)
+    return -1;
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +224,15 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// hand the n bufs in bs, which hold consecutive blocks, to
+// the device as one request, using the n+2 descriptors in idx.
+// caller holds disk.vdisk_lock.
+static void
+submit(struct buf **bs, int n, int write, int *idx, int async)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,51 +249,145 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  // one data descriptor per buf, in block order.
+  for(int i = 0; i < n; i++){
+    int d = idx[1+i];
+    disk.desc[d].addr = (uint64) bs[i]->data;
+    disk.desc[d].len = BSIZE;
+    if(write)
+      disk.desc[d].flags = 0; // device reads b->data
+    else
+      disk.desc[d].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[d].flags |= VRING_DESC_F_NEXT;
+    disk.desc[d].next = idx[2+i];
+  }
 
+  int st = idx[n+1];
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[st].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[st].len = 1;
+  disk.desc[st].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[st].next = 0;
+
+  // record the bufs for virtio_disk_intr().
+  for(int i = 0; i < n; i++){
+    bs[i]->disk = 1;
+    bs[i]->qnext = i+1 < n ? bs[i+1] : 0;
+  }
+  disk.info[idx[0]].b = bs[0];
+  disk.info[idx[0]].async = async;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[disk.avail->idx % disk.num] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  disk.avail->idx += 1; // not % num ...
 
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// The most blocks one request may hold: MAXSEG, or fewer
+// if the device's queue is too short for MAXSEG+2 descriptors.
+int
+virtio_disk_maxseg(void)
+{
+  return disk.maxseg;
+}
+
+// check that the n bufs in bs can be one request.
+static void
+checkbufs(struct buf **bs, int n, char *who)
+{
+  if(n < 1 || n > disk.maxseg)
+    panic(who);
+  for(int i = 1; i < n; i++)
+    if(bs[i]->dev != bs[0]->dev || bs[i]->blockno != bs[0]->blockno + i)
+      panic(who);
+}
+
+// Queue a request to read or write the n bufs in bs, which
+// are locked and hold consecutive blocks, sleeping until
+// descriptors are free if the queue is full. Returns without
+// waiting for the disk; many requests can be in flight at once.
+// Use virtio_disk_wait() on each buf to wait for it.
+void
+virtio_disk_submit(struct buf **bs, int n, int write)
+{
+  int idx[MAXSEG+2];
+
+  checkbufs(bs, n, "virtio_disk_submit");
+
+  acquire(&disk.vdisk_lock);
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  // the spec's Section 5.2 says that legacy block operations use
+  // at least three descriptors: one for type/reserved/sector,
+  // one per data buffer, one for a 1-byte status result.
+
+  // allocate the descriptors.
+  while(1){
+    if(alloc_descs(idx, n+2) == 0) {
+      break;
+    }
+    sleep(&disk.free[0], &disk.vdisk_lock);
+  }
+
+  submit(bs, n, write, idx, 0);
+
+  release(&disk.vdisk_lock);
+}
+
+// Wait for virtio_disk_intr() to say the request for b
+// from virtio_disk_submit() has finished.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
+  release(&disk.vdisk_lock);
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(&b, 1, write);
+  virtio_disk_wait(b);
+}
+
+// Start reading the n bufs in bs, which are locked and hold
+// consecutive blocks, as one request without waiting for the
+// disk; virtio_disk_intr() hands each to bdone() when the read
+// is done. Returns -1, leaving them alone, if the queue is full.
+int
+virtio_disk_start(struct buf **bs, int n)
+{
+  int idx[MAXSEG+2];
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  checkbufs(bs, n, "virtio_disk_start");
 
+  acquire(&disk.vdisk_lock);
+  if(alloc_descs(idx, n+2) < 0){
+    release(&disk.vdisk_lock);
+    return -1;
+  }
+  submit(bs, n, 0, idx, 1);
   release(&disk.vdisk_lock);
+  return 0;
 }
 
+// Complete every request the device has finished since the
+// last interrupt: free its descriptors, then wake its waiter
+// or, for virtio_disk_start(), hand the buffers to bdone().
 void
 virtio_disk_intr()
 {
+  int freed = 0;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -311,17 +405,39 @@ virtio_disk_intr()
 
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    int id = disk.used->ring[disk.used_idx % disk.num].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
+    struct buf *b = disk.info[id].b, *nb;
+    int async = disk.info[id].async;
+    disk.info[id].b = 0;
+    free_chain(id);
+    freed = 1;
     disk.used_idx += 1;
+
+    if(async){
+      // bdone() takes buffer cache locks.
+      release(&disk.vdisk_lock);
+      for(; b; b = nb){
+        nb = b->qnext;
+        b->disk = 0;   // disk is done with buf
+        bdone(b);
+      }
+      acquire(&disk.vdisk_lock);
+    } else {
+      for(; b; b = nb){
+        nb = b->qnext;
+        b->disk = 0;
+        wakeup(b);
+      }
+    }
   }
 
+  // wake submitters waiting for descriptors once per batch.
+  if(freed)
+    wakeup(&disk.free[0]);
+
   release(&disk.vdisk_lock);
 }
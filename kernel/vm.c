@@ -5,6 +5,11 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "proc.h"
+#include "fcntl.h"
 
 /*
  * the kernel's page table.
@@ -24,6 +29,9 @@ kvmmake(void)
   kpgtbl = (pagetable_t) kalloc();
   memset(kpgtbl, 0, PGSIZE);
 
+  // CLINT msip registers, for sending IPIs
+  kvmmap(kpgtbl, CLINT, CLINT, PGSIZE, PTE_R | PTE_W);
+
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
@@ -56,18 +64,129 @@ kvminit(void)
   kernel_pagetable = kvmmake();
 }
 
+// Address space IDs.
+//
+// Each process's user page table gets an ASID, which goes in
+// satp and tags its TLB entries, so that switching between
+// the kernel (ASID 0) and user space needs no TLB flush; the
+// kernel instead flushes the entries it makes stale with
+// targeted sfence.vma instructions (see tlbflush()).
+//
+// ASIDs are handed out in generations. p->asid holds the
+// generation in the bits above asidbits. When a generation's
+// ASIDs run out, a new one starts, every process gets a new
+// ASID the next time it returns to user space, and each hart
+// flushes its whole TLB before using an ASID of the new one.
+// A hart that has already moved to the new generation may
+// still hold entries for an ASID from before the wrap, so a
+// freshly assigned ASID is flushed on the hart that takes it.
+//
+// A process's page table is only changed by the process
+// itself, and it flushes on the hart it is running on. Other
+// harts may still hold stale entries from when it ran there,
+// so a process that moves to another hart flushes its ASID
+// there first.
+//
+// If the hardware has no ASIDs (asidbits == 0), every
+// process uses ASID 0 and trampoline.S flushes the TLB on
+// every switch instead.
+
+int asidbits;
+struct spinlock asid_lock;
+uint64 asid_gen;      // current generation, in the bits above asidbits
+uint64 asid_next;     // next unused ASID of this generation
+
 // Switch h/w page table register to the kernel's page table,
 // and enable paging.
 void
 kvminithart()
 {
+  uint64 asid;
+  int n;
+
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
+  // find out how many ASID bits the hardware implements.
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(0xFFFF));
+  asid = (r_satp() >> 44) & 0xFFFF;
+  for(n = 0; asid & (1L << n); n++)
+    ;
+
   w_satp(MAKE_SATP(kernel_pagetable));
 
   // flush stale entries from the TLB.
   sfence_vma();
+
+  if(cpuid() == 0){
+    initlock(&asid_lock, "asid");
+    asidbits = n;
+    asid_gen = 1L << n;
+    asid_next = 1;
+  }
+  mycpu()->asidgen = asid_gen;
+}
+
+// Return the satp ASID for the current process, which is
+// about to return to user space, giving it a new one if
+// its generation is over, and flush this hart's TLB as
+// described above. Called with interrupts off.
+uint64
+uvmasid(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen, asid;
+  int fresh = 0;
+
+  if(asidbits == 0)
+    return 0;
+
+  gen = __atomic_load_n(&asid_gen, __ATOMIC_ACQUIRE);
+  if((p->asid >> asidbits) != (gen >> asidbits)){
+    acquire(&asid_lock);
+    if(asid_next == (1L << asidbits)){
+      asid_gen += 1L << asidbits;
+      asid_next = 1;
+    }
+    p->asid = asid_gen | asid_next++;
+    gen = asid_gen;
+    release(&asid_lock);
+    fresh = 1;
+  }
+  asid = p->asid & ((1L << asidbits) - 1);
+
+  if(c->asidgen != gen){
+    sfence_vma();
+    c->asidgen = gen;
+  }
+  // a new ASID may still tag entries left from an earlier
+  // generation, and this hart may hold stale entries for p
+  // if p last ran elsewhere. the full flush above covers
+  // both only when this hart moves to a new generation.
+  if(fresh || p->tlbcpu != cpuid())
+    sfence_vma_asid(asid);
+  p->tlbcpu = cpuid();
+  return asid;
+}
+
+// Flush the TLB entries for va, or the whole address space
+// if va is -1, after a change to pagetable. Only the current
+// process's page table can be cached: a new page table hasn't
+// been used yet, and a dead process's ASID is never used
+// again in this generation.
+static void
+tlbflush(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  uint64 asid;
+
+  if(asidbits == 0 || p == 0 || p->pagetable != pagetable || p->asid == 0)
+    return;
+  asid = p->asid & ((1L << asidbits) - 1);
+  if(va == -1)
+    sfence_vma_asid(asid);
+  else
+    sfence_vma_page(va, asid);
 }
 
 // Return the address of the PTE in page table pagetable
@@ -82,26 +201,63 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A level-1 PTE may itself be a leaf, mapping a 2MB
+// megapage. walklevel() stops there and sets *level to 1;
+// otherwise it returns the level-0 PTE and sets *level to 0.
 pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  *level = 0;
+  for(int l = 2; l > 0; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X)){
+        *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// Like walklevel(), but always returns a level-0 PTE.
+// A megapage covering va is split into ordinary pages
+// first if alloc!=0; otherwise it makes walk() return 0.
+pte_t *
+walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte;
+  int level;
+
+  pte = walklevel(pagetable, va, alloc, &level);
+  if(pte && level > 0){
+    if(!alloc || uvmsplit(pagetable, SUPERPGROUNDDOWN(va) + PGSIZE) < 0)
+      return 0;
+    pte = walklevel(pagetable, va, alloc, &level);
+  }
+  return pte;
+}
+
+// The physical address that leaf PTE pte, found at level
+// by walklevel(), maps va to, rounded down to a page.
+static uint64
+ptepa(pte_t *pte, int level, uint64 va)
+{
+  uint64 pa = PTE2PA(*pte);
+  if(level > 0)
+    pa += PGROUNDDOWN(va) & (SUPERPGSIZE - 1);
+  return pa;
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -109,30 +265,72 @@ uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
-  return pa;
+  return ptepa(pte, level, va);
+}
+
+// Map one 2MB megapage at va. va and pa must be
+// aligned to SUPERPGSIZE, and nothing may be mapped in
+// [va, va+SUPERPGSIZE) yet, not even a level-0 table.
+// Returns 0 on success, -1 if out of memory.
+static int
+mapmega(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+
+  if((va % SUPERPGSIZE) != 0 || (pa % SUPERPGSIZE) != 0)
+    panic("mapmega: not aligned");
+  if((*pte & PTE_V) == 0){
+    pagetable_t l1 = (pagetable_t)kzalloc();
+    if(l1 == 0)
+      return -1;
+    *pte = PA2PTE(l1) | PTE_V;
+  }
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  if(*pte & PTE_V)
+    panic("mapmega: remap");
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  return 0;
 }
 
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// uses megapages for the aligned 2MB parts of the range,
+// to keep the RAM direct map from crowding the TLB.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 n;
+
+  while(sz > 0){
+    if(va % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 && sz >= SUPERPGSIZE){
+      if(mapmega(kpgtbl, va, pa, perm) != 0)
+        panic("kvmmap");
+      n = SUPERPGSIZE;
+    } else {
+      // ordinary pages up to the next 2MB boundary.
+      n = SUPERPGROUNDUP(va + 1) - va;
+      if(n > sz)
+        n = sz;
+      if(mappages(kpgtbl, va, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+    va += n;
+    pa += n;
+    sz -= n;
+  }
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -172,22 +370,40 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never faulted in are
+// skipped. A megapage that lies wholly in the range is
+// removed at once; one that doesn't is split first (see
+// uvmsplit(), which callers can use to fail gracefully
+// instead of panicking when that runs out of memory).
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end = va + npages*PGSIZE;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  for(a = va; a < end; a += PGSIZE){
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0)
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
+    if(level > 0){
+      if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= end){
+        if(do_free)
+          ksuperfree((void*)PTE2PA(*pte));
+        *pte = 0;
+        if(npages <= 32)
+          tlbflush(pagetable, a);
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      if((pte = walk(pagetable, a, 1)) == 0)
+        panic("uvmunmap: split");
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -195,7 +411,121 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
       kfree((void*)pa);
     }
     *pte = 0;
+    if(npages <= 32)
+      tlbflush(pagetable, a);
+  }
+  // the kernel never reaches user memory through the TLB,
+  // so a big range can be flushed once, before the process
+  // runs again.
+  if(npages > 32)
+    tlbflush(pagetable, -1);
+}
+
+// Split the megapage covering va, if any, into 512
+// ordinary pages, so that the part below va can be
+// treated separately from the rest. Does nothing if va is
+// on a 2MB boundary.
+// returns 0 on success, -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte, pte1;
+  pagetable_t l0;
+  uint64 pa;
+  int level;
+
+  if(va % SUPERPGSIZE == 0 || va >= MAXVA)
+    return 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || level == 0)
+    return 0;
+  if((l0 = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pte1 = *pte;
+  pa = PTE2PA(pte1);
+  if(*pte & PTE_U)
+    ksupersplit((void*)pa);
+  for(int i = 0; i < 512; i++)
+    l0[i] = PA2PTE(pa + i*PGSIZE) | PTE_FLAGS(pte1);
+  *pte = PA2PTE(l0) | PTE_V;
+  tlbflush(pagetable, -1);
+  return 0;
+}
+
+// Map a zeroed 2MB megapage over the whole aligned 2MB
+// range around va, if that lies within [lo, hi) and
+// nothing in it is mapped yet.
+// returns 0 if it did, -1 if va needs an ordinary page.
+static int
+uvmmega(pagetable_t pagetable, uint64 va, uint64 lo, uint64 hi, int perm)
+{
+  uint64 base = SUPERPGROUNDDOWN(va);
+  pte_t *pte;
+  char *mem;
+
+  if(base < lo || base + SUPERPGSIZE > hi)
+    return -1;
+  pte = &pagetable[PX(2, base)];
+  if(*pte & PTE_V){
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(1, base)];
+    if(*pte & PTE_V)
+      return -1;
+  }
+  if((mem = ksuperalloc()) == 0)
+    return -1;
+  memset(mem, 0, SUPERPGSIZE);
+  if(mapmega(pagetable, base, (uint64)mem, perm) != 0){
+    ksuperfree(mem);
+    return -1;
   }
+  tlbflush(pagetable, base);
+  return 0;
+}
+
+// If the aligned 2MB range around va lies within
+// [lo, hi) and is now fully populated with private pages
+// of the same permissions, move them into one megapage.
+// The caller must know that no page in [lo, hi) is
+// shared with a file.
+static void
+uvmpromote(pagetable_t pagetable, uint64 va, uint64 lo, uint64 hi)
+{
+  uint64 base = SUPERPGROUNDDOWN(va);
+  pte_t *pte, *l0;
+  uint flags;
+  char *mem;
+  int i;
+
+  if(base < lo || base + SUPERPGSIZE > hi)
+    return;
+
+  pte = &pagetable[PX(2, base)];
+  if((*pte & PTE_V) == 0)
+    return;
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, base)];
+  if((*pte & PTE_V) == 0 || (*pte & (PTE_R|PTE_W|PTE_X)))
+    return;
+  l0 = (pte_t*)PTE2PA(*pte);
+
+  flags = PTE_FLAGS(l0[0]) & ~(PTE_A|PTE_D);
+  for(i = 0; i < 512; i++){
+    if((l0[i] & PTE_V) == 0 || (PTE_FLAGS(l0[i]) & ~(PTE_A|PTE_D)) != flags)
+      return;
+    if(krefcnt((void*)PTE2PA(l0[i])) != 1)
+      return;
+  }
+  if((flags & PTE_U) == 0 || (flags & PTE_COW))
+    return;
+  if((mem = ksuperalloc()) == 0)
+    return;
+  for(i = 0; i < 512; i++)
+    memmove(mem + i*PGSIZE, (char*)PTE2PA(l0[i]), PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  // flush before the old pages can be reused.
+  tlbflush(pagetable, -1);
+  for(i = 0; i < 512; i++)
+    kfree((void*)PTE2PA(l0[i]));
+  kfree(l0);
 }
 
 // create an empty user page table.
@@ -204,10 +534,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -221,8 +550,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kzalloc();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -240,12 +568,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kzalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -303,42 +630,489 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Map the pages of old in [start, end) into new.
+// Writable pages become copy-on-write in both unless
+// share is set, in which case both keep writing the
+// same page.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
-int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+static int
+copypages(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
+  int level;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = walklevel(old, i, 0, &level)) == 0 || (*pte & PTE_V) == 0)
+      continue;  // not faulted in yet; the child will fault it too.
+    // copy-on-write works on ordinary pages; split megapages.
+    if(level > 0 && (pte = walk(old, i, 1)) == 0)
+      goto err;
+    if((*pte & PTE_W) && !share)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    kincref((void*)pa);
+  }
+  // the parent's writable pages just became read-only.
+  tlbflush(old, -1);
+  return 0;
+
+ err:
+  tlbflush(old, -1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
+  return -1;
+}
+
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Writable pages become read-only and copy-on-write
+// in both; the first store to one is handled by uvmcow().
+// Only the page-table pages are allocated here.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return copypages(old, new, 0, sz, 0);
+}
+
+// Like uvmcopy(), for the mmap() regions v above p->sz.
+// MAP_SHARED pages stay shared between parent and child.
+int
+vmacopy(pagetable_t old, pagetable_t new, struct vma *v)
+{
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    if(v[i].flags == 0)
+      continue;
+    if(copypages(old, new, v[i].start, v[i].end, v[i].flags & MAP_SHARED) < 0)
       goto err;
-    }
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  while(--i >= 0)
+    if(v[i].flags)
+      uvmunmap(new, v[i].start, (v[i].end - v[i].start) / PGSIZE, 1);
   return -1;
 }
 
+// Resolve a write to the copy-on-write page at va:
+// copy it unless this page table holds the only reference,
+// then make the PTE writable again.
+// returns 0 on success, -1 if va is not a COW page
+// or there is no memory for the copy.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+     (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcnt((void*)pa) == 1){
+    // the other sharers are gone; take the page over.
+    *pte = PA2PTE(pa) | flags;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)pa, PGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    tlbflush(pagetable, va);
+    kfree((void*)pa);
+    return 0;
+  }
+  tlbflush(pagetable, va);
+  return 0;
+}
+
+// Copy a process's regions for fork, taking a
+// reference on each backing inode.
+void
+vmadup(struct vma *dst, struct vma *src)
+{
+  for(int i = 0; i < NVMA; i++){
+    dst[i] = src[i];
+    if(src[i].ip)
+      dst[i].ip = idup(src[i].ip);
+  }
+}
+
+// Write the dirty pages of shared file mapping v in
+// [a, b) back to the file.
+static void
+vmawriteback(pagetable_t pagetable, struct vma *v, uint64 a, uint64 b)
+{
+  pte_t *pte;
+  uint64 off, n;
+
+  if((v->flags & MAP_SHARED) == 0 || v->ip == 0)
+    return;
+  for(; a < b; a += PGSIZE){
+    off = a - v->start;
+    if(off >= v->filesz)
+      break;
+    pte = walk(pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    n = v->filesz - off;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    begin_op();
+    ilock(v->ip);
+    writei(v->ip, 0, PTE2PA(*pte), v->off + off, n);
+    iunlock(v->ip);
+    end_op();
+  }
+}
+
+// Release a whole region: write back and unmap the
+// pages of an mmap() region (exec'd segments are freed
+// with the rest of the image), then drop the file.
+static void
+vmarelease(pagetable_t pagetable, struct vma *v)
+{
+  if(v->flags && pagetable){
+    vmawriteback(pagetable, v, v->start, v->end);
+    uvmunmap(pagetable, v->start, (v->end - v->start) / PGSIZE, 1);
+  }
+  if(v->ip){
+    begin_op();
+    iput(v->ip);
+    end_op();
+  }
+  memset(v, 0, sizeof(*v));
+}
+
+// Drop all of a process's regions, for exit and exec.
+// pagetable may be 0 if none of them were mapped.
+// Must not be called inside a transaction.
+void
+vmaput(pagetable_t pagetable, struct vma *v)
+{
+  for(int i = 0; i < NVMA; i++)
+    if(v[i].end)
+      vmarelease(pagetable, &v[i]);
+}
+
+// Does [a, b) overlap any region of p?
+int
+vmaoverlap(struct proc *p, uint64 a, uint64 b)
+{
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && a < v->end && v->start < b)
+      return 1;
+  return 0;
+}
+
+// Create a len-byte mapping of f at offset off for the
+// current process, placed below the trapframe in the
+// highest hole that fits. Pages are faulted in later.
+// returns the address, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *free = 0;
+  uint64 top, a;
+  int perm;
+
+  if(len == 0 || len >= MAXVA || off % PGSIZE != 0)
+    return -1;
+  if((prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0 ||
+     (flags & ~(MAP_SHARED|MAP_PRIVATE|MAP_ANONYMOUS)) != 0)
+    return -1;
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+     (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+    return -1;
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(f == 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  perm = PTE_U;
+  if(prot & PROT_READ)
+    perm |= PTE_R;
+  if(prot & PROT_WRITE)
+    perm |= PTE_R | PTE_W;  // W without R is reserved in Sv39
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end == 0){
+      free = v;
+      break;
+    }
+  if(free == 0)
+    return -1;
+
+  // find the highest free range, moving down past each
+  // region that overlaps it.
+  len = PGROUNDUP(len);
+  top = TRAPFRAME;
+  for(;;){
+    if(top < len || top - len < PGROUNDUP(p->sz))
+      return -1;
+    a = top - len;
+    for(v = p->vma; v < &p->vma[NVMA]; v++)
+      if(v->end && a < v->end && v->start < top)
+        break;
+    if(v == &p->vma[NVMA])
+      break;
+    top = v->start;
+  }
+
+  v = free;
+  v->start = a;
+  v->end = a + len;
+  v->perm = perm;
+  v->flags = flags & (MAP_SHARED|MAP_PRIVATE);
+  v->off = off;
+  v->filesz = 0;
+  v->ip = 0;
+  if((flags & MAP_ANONYMOUS) == 0){
+    v->ip = idup(f->ip);
+    ilock(v->ip);
+    if(off < v->ip->size)
+      v->filesz = v->ip->size - off < len ? v->ip->size - off : len;
+    iunlock(v->ip);
+  }
+  return a;
+}
+
+// Remove the current process's mappings in
+// [addr, addr+len), writing dirty shared pages back
+// first. The range may cover parts of several mmap()
+// regions; a hole punched in the middle of one splits it.
+// returns 0, or -1 if the range is bad or a split
+// needs a free slot.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv, *free = 0;
+  uint64 a, b, end = addr + len;
+
+  if(addr % PGSIZE != 0 || len == 0 || end < addr || end > TRAPFRAME)
+    return -1;
+  end = PGROUNDUP(end);
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 && free == 0)
+      free = v;
+    if(v->end && v->flags == 0 && addr < v->end && v->start < end)
+      return -1;  // not an mmap() region
+  }
+  // megapages that straddle the ends must be split.
+  if(uvmsplit(p->pagetable, addr) < 0 || uvmsplit(p->pagetable, end) < 0)
+    return -1;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->flags == 0 || end <= v->start || v->end <= addr)
+      continue;
+    a = addr > v->start ? addr : v->start;
+    b = end < v->end ? end : v->end;
+    if(a == v->start && b == v->end){
+      vmarelease(p->pagetable, v);
+      continue;
+    }
+    if(a > v->start && b < v->end){
+      // punch a hole: the part above it moves to a new slot.
+      if(free == 0)
+        return -1;
+      nv = free;
+      free = 0;
+      *nv = *v;
+      if(nv->ip)
+        idup(nv->ip);
+      nv->start = b;
+      nv->off = v->off + (b - v->start);
+      nv->filesz = v->filesz > b - v->start ? v->filesz - (b - v->start) : 0;
+      v->end = b;
+    }
+    vmawriteback(p->pagetable, v, a, b);
+    uvmunmap(p->pagetable, a, (b - a) / PGSIZE, 1);
+    if(a == v->start){
+      v->off += b - a;
+      v->filesz = v->filesz > b - a ? v->filesz - (b - a) : 0;
+      v->start = b;
+    } else {
+      if(v->filesz > a - v->start)
+        v->filesz = a - v->start;
+      v->end = a;
+    }
+  }
+  return 0;
+}
+
+// Read the page at va of region v into a new page
+// and map it. Whole file pages of read-only regions
+// come from the inode's shared text cache instead.
+static int
+vmafill(pagetable_t pagetable, struct vma *v, uint64 va)
+{
+  uint64 n, off = va - v->start;
+  char *mem;
+  int locked, atomic, shared;
+  int anon = v->ip == 0 && (v->flags & MAP_SHARED) == 0;
+
+  // reading the file may sleep, which isn't allowed while
+  // holding a spinlock; such callers use uvmprefault() first.
+  push_off();
+  atomic = mycpu()->noff > 1;
+  pop_off();
+  if(atomic && off < v->filesz)
+    return -1;
+
+  if(off >= v->filesz){
+    // large private anonymous regions get megapages.
+    if(anon && uvmmega(pagetable, va, v->start, v->end, v->perm) == 0)
+      return 0;
+    if((mem = kzalloc()) == 0)
+      return -1;
+    goto map;
+  }
+
+  // a read() of the program's own file into its
+  // not-yet-loaded data already holds the inode lock.
+  locked = holdingsleep(&v->ip->lock);
+  if(!locked)
+    ilock(v->ip);
+  shared = (v->perm & PTE_W) == 0 && off + PGSIZE <= v->filesz;
+  if(shared && (mem = itextget(v->ip, v->off + off)) != 0)
+    goto unlock;
+  if((mem = kzalloc()) == 0)
+    goto bad;
+  n = v->filesz - off;
+  if(n > PGSIZE)
+    n = PGSIZE;
+  if(readi(v->ip, 0, (uint64)mem, v->off + off, n) != n){
+    kfree(mem);
+    goto bad;
+  }
+  if(shared)
+    itextput(v->ip, v->off + off, mem);
+ unlock:
+  if(!locked)
+    iunlock(v->ip);
+
+ map:
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, v->perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  // the trampoline no longer flushes on every entry, and
+  // a hart may have cached the invalid PTE.
+  tlbflush(pagetable, va);
+  if(anon)
+    uvmpromote(pagetable, va, v->start, v->end);
+  return 0;
+
+ bad:
+  if(!locked)
+    iunlock(v->ip);
+  return -1;
+}
+
+// Handle a page fault by the current process at va.
+// write is 1 for a store. Pages of a region in p->vma are
+// read in from its file; heap pages between the last
+// mapped page and p->sz are allocated and zeroed on first
+// touch; stores to copy-on-write pages get a private copy.
+// Called from usertrap() and from copyin()/copyout(), so
+// pagetable must be the current process's.
+// returns 0 if the access can now be retried, -1 if it is
+// a real fault.
+int
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+  int level;
+
+  if(p == 0 || pagetable != p->pagetable || va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return uvmcow(pagetable, va);
+    if(write && (*pte & PTE_W) && (*pte & PTE_U) && (*pte & PTE_D) == 0){
+      // hardware that doesn't set the dirty bit itself.
+      *pte |= PTE_A | PTE_D;
+      tlbflush(pagetable, va);
+      return 0;
+    }
+    return -1;
+  }
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end && va >= v->start && va < v->end){
+      if(write && (v->perm & PTE_W) == 0)
+        return -1;
+      return vmafill(pagetable, v, va);
+    }
+  }
+
+  if(va >= p->sz)
+    return -1;
+
+  // demand-zero heap page, or a whole megapage if the
+  // heap covers its 2MB and no exec'd segment shares it.
+  if(!vmaoverlap(p, SUPERPGROUNDDOWN(va), SUPERPGROUNDDOWN(va) + SUPERPGSIZE) &&
+     uvmmega(pagetable, va, 0, p->sz, PTE_R|PTE_W|PTE_U) == 0)
+    return 0;
+  if((mem = kzalloc()) == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  tlbflush(pagetable, va);
+  if(!vmaoverlap(p, SUPERPGROUNDDOWN(va), SUPERPGROUNDDOWN(va) + SUPERPGSIZE))
+    uvmpromote(pagetable, va, 0, p->sz);
+  return 0;
+}
+
+// Fault in the current process's pages covering
+// [va, va+len), for callers that copy to or from user
+// memory while holding a spinlock and so can't sleep
+// in vmfault(). Errors are left for the copy to report.
+void
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len, int write)
+{
+  uint64 a;
+  pte_t *pte;
+  int level;
+
+  for(a = PGROUNDDOWN(va); a < va + len && a < MAXVA; a += PGSIZE){
+    pte = walklevel(pagetable, a, 0, &level);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_COW)))
+      if(vmfault(pagetable, a, write) < 0)
+        return;
+  }
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -360,16 +1134,25 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
   pte_t *pte;
+  int level;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
     if(va0 >= MAXVA)
       return -1;
-    pte = walk(pagetable, va0, 0);
+    pte = walklevel(pagetable, va0, 0, &level);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_COW)){
+      if(vmfault(pagetable, va0, 1) < 0)
+        return -1;
+      pte = walklevel(pagetable, va0, 0, &level);
+    }
     if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
        (*pte & PTE_W) == 0)
       return -1;
-    pa0 = PTE2PA(*pte);
+    // the hardware doesn't see this store; mark the page
+    // dirty so that a shared mapping writes it back.
+    *pte |= PTE_A | PTE_D;
+    pa0 = ptepa(pte, level, va0);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -393,8 +1176,11 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -420,8 +1206,11 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
@@ -16,6 +16,7 @@
 #endif
 
 #define NINODES 200
+#define ZEROBLOCKS 64  // blocks zeroed per write() when creating the image
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
@@ -28,13 +29,14 @@ int nblocks;  // Number of data blocks
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
+char zeroes[BSIZE*ZEROBLOCKS];
 uint freeinode = 1;
 uint freeblock;
 
 
 void balloc(int);
 void wsect(uint, void*);
+void wsects(uint, void*, uint);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
@@ -107,8 +109,8 @@ main(int argc, char *argv[])
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  for(i = 0; i < FSSIZE; i += ZEROBLOCKS)
+    wsects(i, zeroes, FSSIZE - i < ZEROBLOCKS ? FSSIZE - i : ZEROBLOCKS);
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -176,10 +178,17 @@ main(int argc, char *argv[])
 
 void
 wsect(uint sec, void *buf)
+{
+  wsects(sec, buf, 1);
+}
+
+// write n consecutive sectors with one write().
+void
+wsects(uint sec, void *buf, uint n)
 {
   if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
     die("lseek");
-  if(write(fsfd, buf, BSIZE) != BSIZE)
+  if(write(fsfd, buf, n * BSIZE) != n * BSIZE)
     die("write");
 }
 
@@ -0,0 +1,258 @@
+// schedbench: measure scheduler fairness, wakeup latency and
+// context-switch rate under a mix of CPU-bound, I/O-bound and
+// mixed processes.
+//
+// usage: schedbench [-c ncpu] [-i nio] [-m nmix] [-t ticks]
+//
+// every output line starts with "bench" and is a list of
+// key=value pairs, so results from different kernels can be
+// collected with grep and compared by a script. times are in
+// time CSR cycles (rdtime), shares and fairness in permille.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/schedstat.h"
+#include "user/user.h"
+
+#define CPU  0
+#define IO   1
+#define MIX  2
+
+#define MAXWORKERS 16
+#define MIXBURST   500000   // cycles of work per wakeup for MIX
+
+char *kindname[] = { "cpu", "io", "mix" };
+
+struct result {
+  int kind;
+  uint64 work;     // units of work done
+  uint64 nwake;    // wakeups observed
+  uint64 latsum;   // sum of wakeup-to-run latencies
+  uint64 latmax;
+  struct schedstat st;
+};
+
+static inline uint64
+rdtime(void)
+{
+  uint64 x;
+  asm volatile("rdtime %0" : "=r" (x));
+  return x;
+}
+
+static void
+spin(int n)
+{
+  for(volatile int i = 0; i < n; i++)
+    ;
+}
+
+// CPU-bound: compute until the deadline.
+static void
+cpuwork(struct result *r, int end)
+{
+  while(uptime() < end){
+    spin(10000);
+    r->work++;
+  }
+}
+
+// I/O-bound and mixed: block on a pipe that a ticker child
+// writes a timestamp into once per tick. the difference between
+// that timestamp and the time we get to run is the latency from
+// wakeup to running.
+static void
+wakework(struct result *r, int end, int burst)
+{
+  int fds[2];
+  uint64 t, lat;
+
+  if(pipe(fds) < 0){
+    fprintf(2, "schedbench: pipe failed\n");
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    fprintf(2, "schedbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    while(uptime() < end){
+      sleep(1);
+      t = rdtime();
+      if(write(fds[1], &t, sizeof(t)) != sizeof(t))
+        break;
+    }
+    exit(0);
+  }
+  close(fds[1]);
+
+  while(read(fds[0], &t, sizeof(t)) == sizeof(t)){
+    lat = rdtime() - t;
+    r->nwake++;
+    r->latsum += lat;
+    if(lat > r->latmax)
+      r->latmax = lat;
+    if(burst){
+      t = rdtime();
+      while(rdtime() - t < burst){
+        spin(1000);
+        r->work++;
+      }
+    } else {
+      spin(1000);
+      r->work++;
+    }
+  }
+  close(fds[0]);
+  wait(0);
+}
+
+static void
+worker(int kind, int end, int out)
+{
+  struct result r;
+
+  memset(&r, 0, sizeof(r));
+  r.kind = kind;
+  if(kind == CPU)
+    cpuwork(&r, end);
+  else
+    wakework(&r, end, kind == MIX ? MIXBURST : 0);
+  if(getsched(0, &r.st) < 0)
+    fprintf(2, "schedbench: getsched failed\n");
+  write(out, &r, sizeof(r));
+  close(out);
+  exit(0);
+}
+
+static void
+usage(void)
+{
+  fprintf(2, "usage: schedbench [-c ncpu] [-i nio] [-m nmix] [-t ticks]\n");
+  exit(1);
+}
+
+static int
+getarg(int argc, char *argv[], int *i)
+{
+  if(*i + 1 >= argc)
+    usage();
+  *i += 1;
+  return atoi(argv[*i]);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nkind[3] = { 2, 2, 1 };
+  int duration = 50;
+  struct result res[MAXWORKERS];
+  struct schedstat self0, self1;
+  int fds[2];
+  int n, i, k;
+
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-c") == 0)
+      nkind[CPU] = getarg(argc, argv, &i);
+    else if(strcmp(argv[i], "-i") == 0)
+      nkind[IO] = getarg(argc, argv, &i);
+    else if(strcmp(argv[i], "-m") == 0)
+      nkind[MIX] = getarg(argc, argv, &i);
+    else if(strcmp(argv[i], "-t") == 0)
+      duration = getarg(argc, argv, &i);
+    else
+      usage();
+  }
+  n = nkind[CPU] + nkind[IO] + nkind[MIX];
+  if(n < 1 || n > MAXWORKERS || duration < 1){
+    fprintf(2, "schedbench: need 1..%d workers and a positive duration\n",
+            MAXWORKERS);
+    exit(1);
+  }
+
+  printf("bench config ncpu=%d nio=%d nmix=%d ticks=%d\n",
+         nkind[CPU], nkind[IO], nkind[MIX], duration);
+
+  if(pipe(fds) < 0){
+    fprintf(2, "schedbench: pipe failed\n");
+    exit(1);
+  }
+
+  getsched(0, &self0);
+  uint64 start = rdtime();
+  int end = uptime() + duration;
+  for(k = 0; k < 3; k++){
+    for(i = 0; i < nkind[k]; i++){
+      int pid = fork();
+      if(pid < 0){
+        fprintf(2, "schedbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0){
+        close(fds[0]);
+        worker(k, end, fds[1]);
+      }
+    }
+  }
+  close(fds[1]);
+
+  for(i = 0; i < n; i++){
+    if(read(fds[0], &res[i], sizeof(res[i])) != sizeof(res[i])){
+      fprintf(2, "schedbench: lost a worker result\n");
+      exit(1);
+    }
+  }
+  for(i = 0; i < n; i++)
+    wait(0);
+  uint64 elapsed = rdtime() - start;
+  getsched(0, &self1);
+
+  // per-process lines.
+  uint64 total = 0, cswitch = 0;
+  for(i = 0; i < n; i++){
+    total += res[i].st.runtime;
+    cswitch += res[i].st.nvcsw + res[i].st.nivcsw;
+  }
+  cswitch += (self1.nvcsw + self1.nivcsw) - (self0.nvcsw + self0.nivcsw);
+  if(total == 0)
+    total = 1;
+
+  uint64 nwake = 0, latsum = 0, latmax = 0;
+  for(i = 0; i < n; i++){
+    struct result *r = &res[i];
+    struct schedstat *st = &r->st;
+    printf("bench proc pid=%d kind=%s work=%lu runtime=%lu wait=%lu"
+           " share=%lu level=%d demote=%u boost=%u vcsw=%u ivcsw=%u"
+           " wakeups=%lu latavg=%lu latmax=%lu\n",
+           st->pid, kindname[r->kind], r->work, st->runtime, st->waittime,
+           st->runtime * 1000 / total, st->level, st->ndemote, st->nboost,
+           st->nvcsw, st->nivcsw, r->nwake,
+           r->nwake ? r->latsum / r->nwake : 0, r->latmax);
+    nwake += r->nwake;
+    latsum += r->latsum;
+    if(r->latmax > latmax)
+      latmax = r->latmax;
+  }
+
+  // Jain's fairness index over CPU-bound runtimes:
+  // (sum x)^2 / (n * sum x^2), 1000 means perfectly fair.
+  // runtimes are scaled down first so the squares fit in 64 bits.
+  uint64 sx = 0, sxx = 0, fair = 1000;
+  for(i = 0; i < n; i++){
+    if(res[i].kind != CPU)
+      continue;
+    uint64 x = res[i].st.runtime / 1000;
+    sx += x;
+    sxx += x * x;
+  }
+  if(nkind[CPU] > 0 && sxx > 0)
+    fair = sx * sx * 1000 / (nkind[CPU] * sxx);
+
+  printf("bench summary elapsed=%lu cswitch=%lu cswitch_per_tick=%lu"
+         " wakeups=%lu latavg=%lu latmax=%lu fairness=%lu\n",
+         elapsed, cswitch, cswitch / duration, nwake,
+         nwake ? latsum / nwake : 0, latmax, fair);
+  exit(0);
+}
@@ -1,4 +1,5 @@
 struct stat;
+struct schedstat;
 
 // system calls
 int fork(void);
@@ -22,6 +23,10 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int getsched(int, struct schedstat*);
+int setsched(int, int, int);
+void* mmap(void*, uint64, int, int, int, int);
+int munmap(void*, uint64);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -4,6 +4,7 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/schedstat.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -2569,6 +2570,1019 @@ sbrk8000(char *s)
   *(top-1) = *(top-1) + 1;
 }
 
+int countfree();
+
+// run f in a child process, and check that all the memory
+// it used is free again once it has exited.
+void
+nopageleak(char *s, void (*f)(char *))
+{
+  int pid, xstatus, free0, free1;
+
+  free0 = countfree();
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    f(s);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if((free1 = countfree()) < free0){
+    printf("%s: lost %d free pages\n", s, free0 - free1);
+    exit(1);
+  }
+}
+
+// write a different byte to the start of each of the n
+// pages at a.
+void
+pagefill(char *a, int n, int v)
+{
+  for(int i = 0; i < n; i++)
+    a[(uint64)i * PGSIZE] = (char)(i + v);
+}
+
+// return the first of the n pages at a that doesn't hold
+// what pagefill(a, n, v) wrote, or -1.
+int
+pagecheck(char *a, int n, int v)
+{
+  for(int i = 0; i < n; i++)
+    if(a[(uint64)i * PGSIZE] != (char)(i + v))
+      return i;
+  return -1;
+}
+
+void
+cowfork1(char *s)
+{
+  enum { N = 64 };
+  int fds[2], pid, xstatus, i;
+  char *a, c;
+
+  a = sbrk(N * PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  pagefill(a, N, 1);
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // wait for the parent to write its copy.
+    if(read(fds[0], &c, 1) != 1){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    if((i = pagecheck(a, N, 1)) >= 0){
+      printf("%s: child sees parent's write to page %d\n", s, i);
+      exit(1);
+    }
+    pagefill(a, N, 2);
+    if((i = pagecheck(a, N, 2)) >= 0){
+      printf("%s: child lost its write to page %d\n", s, i);
+      exit(1);
+    }
+    exit(0);
+  }
+
+  pagefill(a, N, 3);
+  if(write(fds[1], "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if((i = pagecheck(a, N, 3)) >= 0){
+    printf("%s: parent sees child's write to page %d\n", s, i);
+    exit(1);
+  }
+}
+
+// after fork, parent and child share their pages copy-on-write.
+// does each see only its own writes, and are the pages freed
+// once both have exited?
+void
+cowfork(char *s)
+{
+  nopageleak(s, cowfork1);
+}
+
+// a whole page of read-only data, so that it is a shared text
+// page of its own; texttest changes it in a copy of usertests.
+#define TEXTMARK "texttest mark 1"
+const char textmark[PGSIZE] __attribute__((aligned(PGSIZE))) = TEXTMARK;
+
+// run by texttest as "tcopy -x", from a copy of usertests:
+// fault in every page of text up to textmark, report textmark
+// on fd 1, and wait for fd 0 to be closed.
+void
+textchild(void)
+{
+  volatile uint64 a;
+  volatile char sum = 0;
+  char c;
+
+  for(a = 0; a < (uint64)textmark + PGSIZE; a += PGSIZE)
+    sum += *(char*)a;
+  write(1, textmark, sizeof(TEXTMARK));
+  read(0, &c, 1);
+  exit(0);
+}
+
+// start "tcopy -x" with its fd 0 and 1 connected to pipes,
+// check it reports mark, and return the end of its fd 0
+// pipe; closing it lets the child exit.
+int
+textstart(char *s, char *mark)
+{
+  static char *argv[] = { "tcopy", "-x", 0 };
+  int in[2], out[2], pid;
+  char got[sizeof(TEXTMARK)];
+
+  if(pipe(in) < 0 || pipe(out) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(0);
+    dup(in[0]);
+    close(1);
+    dup(out[1]);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    exec("tcopy", argv);
+    exit(1);
+  }
+  close(in[0]);
+  close(out[1]);
+  if(read(out[0], got, sizeof(got)) != sizeof(got) || strcmp(got, mark) != 0){
+    printf("%s: tcopy reported the wrong mark\n", s);
+    exit(1);
+  }
+  close(out[0]);
+  return in[1];
+}
+
+void
+texttest1(char *s)
+{
+  enum { N=4 };
+  int fd, fd2, n, i, k, free1, freen, ntext, stop[N+1];
+
+  // a private copy of the binary, to run and then change.
+  if((fd = open("usertests", O_RDONLY)) < 0 ||
+     (fd2 = open("tcopy", O_CREATE|O_TRUNC|O_WRONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0){
+    if(write(fd2, buf, n) != n){
+      printf("%s: write tcopy failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  close(fd2);
+
+  // more processes running it shouldn't need more copies
+  // of its text.
+  ntext = ((uint64)textmark + PGSIZE) / PGSIZE;
+  stop[0] = textstart(s, TEXTMARK);
+  free1 = countfree();
+  for(i = 1; i <= N; i++)
+    stop[i] = textstart(s, TEXTMARK);
+  freen = countfree();
+  if(free1 - freen >= N * ntext){
+    printf("%s: %d more processes took %d pages, with %d of text each\n",
+           s, N, free1 - freen, ntext);
+    exit(1);
+  }
+  for(i = 1; i <= N; i++){
+    close(stop[i]);
+    wait(0);
+  }
+
+  // writing the file while it runs drops the cached text, so
+  // the next exec sees the change.
+  fd = open("tcopy", O_RDONLY);
+  for(k = 0; (n = read(fd, buf, PGSIZE)) == PGSIZE; k++)
+    if(strcmp(buf, TEXTMARK) == 0)
+      break;
+  close(fd);
+  if(n != PGSIZE){
+    printf("%s: can't find the mark in tcopy\n", s);
+    exit(1);
+  }
+  fd = open("tcopy", O_RDWR);
+  for(i = 0; i < k; i++)
+    read(fd, buf, PGSIZE);
+  strcpy(buf, TEXTMARK);
+  buf[sizeof(TEXTMARK) - 2] = '2';
+  if(write(fd, buf, sizeof(TEXTMARK)) != sizeof(TEXTMARK)){
+    printf("%s: write tcopy failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  stop[1] = textstart(s, buf);
+
+  close(stop[0]);
+  close(stop[1]);
+  wait(0);
+  wait(0);
+  unlink("tcopy");
+}
+
+// processes running the same binary share its text pages,
+// which are dropped when the file is written and freed when
+// the last of them exits.
+void
+texttest(char *s)
+{
+  nopageleak(s, texttest1);
+}
+
+// byte o of a file made by mkbigfile(). it differs from block to
+// block, so that reading the wrong block shows.
+#define BIGBYTE(o) ((char)((o) % 253 + (o) / BSIZE))
+
+// create file name holding n bytes of BIGBYTE().
+void
+mkbigfile(char *s, char *name, int n)
+{
+  int fd, i, m, o;
+
+  unlink(name);
+  fd = open(name, O_CREATE|O_WRONLY);
+  if(fd < 0){
+    printf("%s: create %s failed\n", s, name);
+    exit(1);
+  }
+  for(o = 0; o < n; o += m){
+    m = n - o < BUFSZ ? n - o : BUFSZ;
+    for(i = 0; i < m; i++)
+      buf[i] = BIGBYTE(o + i);
+    if(write(fd, buf, m) != m){
+      printf("%s: write %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+// read name from the start, chunk bytes at a time, and check
+// that it holds the n bytes mkbigfile() wrote and then ends.
+void
+readbigfile(char *s, char *name, int n, int chunk)
+{
+  int fd, i, m, o;
+
+  fd = open(name, O_RDONLY);
+  if(fd < 0){
+    printf("%s: open %s failed\n", s, name);
+    exit(1);
+  }
+  for(o = 0; (m = read(fd, buf, chunk)) > 0; o += m){
+    for(i = 0; i < m; i++){
+      if(buf[i] != BIGBYTE(o + i)){
+        printf("%s: %s: wrong byte at %d\n", s, name, o + i);
+        exit(1);
+      }
+    }
+  }
+  if(m < 0 || o != n){
+    printf("%s: %s: read %d bytes, not %d\n", s, name, o, n);
+    exit(1);
+  }
+  close(fd);
+}
+
+// start a child that takes all the free memory it can get, and
+// holds it until the returned fd is closed; *n is set to the
+// number of pages it got. the child touches its pages with
+// fstat() rather than a store, so that running out makes the
+// system call fail instead of killing the child.
+int
+memhog(char *s, int *n)
+{
+  int ready[2], hold[2], fd, pid;
+  char *a, c;
+
+  if(pipe(ready) < 0 || pipe(hold) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(ready[0]);
+    close(hold[1]);
+    if((fd = open(".", O_RDONLY)) < 0)
+      exit(1);
+    a = sbrk(0);
+    sbrk(PGROUNDUP((uint64)a) - (uint64)a);
+    for(*n = 0; (a = sbrk(PGSIZE)) != (char*)-1; (*n)++)
+      if(fstat(fd, (struct stat*)a) < 0)
+        break;
+    write(ready[1], n, sizeof(*n));
+    read(hold[0], &c, 1);
+    exit(0);
+  }
+  close(ready[1]);
+  close(hold[0]);
+  if(read(ready[0], n, sizeof(*n)) != sizeof(*n)){
+    printf("%s: memhog failed\n", s);
+    exit(1);
+  }
+  close(ready[0]);
+  return hold[1];
+}
+
+// the buffer cache gives its pages back when memory runs out,
+// and once it can grow no more, reads and writes wait for
+// buffers to come free rather than the kernel panicking.
+void
+bcachepressure(char *s)
+{
+  enum { N=200*BSIZE, NW=32*BSIZE, NR=2, NCHILD=4 };
+  int free0, free1, go[2], ready[2], stop, n, i, pid, xstatus, ok;
+  char c, name[] = "bcpw0";
+
+  mkbigfile(s, "bcpbig", N);
+  free0 = countfree();
+  readbigfile(s, "bcpbig", N, BSIZE);
+  free1 = countfree();
+  if(free1 < free0 - N/PGSIZE/2){
+    printf("%s: cache kept %d pages\n", s, free0 - free1);
+    exit(1);
+  }
+
+  if(pipe(go) < 0 || pipe(ready) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      // touch the memory this child will write now, since
+      // there will be none left to copy it into later.
+      memset(buf, 0, BUFSZ);
+      name[4] = '0' + i;
+      close(go[1]);
+      close(ready[0]);
+      write(ready[1], "x", 1);
+      read(go[0], &c, 1);
+      if(i < NR){
+        readbigfile(s, "bcpbig", N, 3*BSIZE+7);
+      } else {
+        mkbigfile(s, name, NW);
+        readbigfile(s, name, NW, BSIZE);
+        unlink(name);
+      }
+      exit(0);
+    }
+  }
+  close(go[0]);
+  close(ready[1]);
+  for(i = 0; i < NCHILD; i++){
+    if(read(ready[0], &c, 1) != 1){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  close(ready[0]);
+
+  // the hog inherits go[1], so wake the children with a byte
+  // each rather than by closing it.
+  stop = memhog(s, &n);
+  for(i = 0; i < NCHILD; i++)
+    write(go[1], "x", 1);
+  close(go[1]);
+  ok = 1;
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      ok = 0;
+  }
+  close(stop);
+  wait(0);
+  unlink("bcpbig");
+  if(!ok){
+    printf("%s: file i/o failed with no free memory\n", s);
+    exit(1);
+  }
+}
+
+// sequential reads of any size see the file's data as the
+// read-ahead window grows and then runs into the end of the
+// file, both with memory to spare and with none left over for
+// the buffer cache.
+void
+readaheadtest(char *s)
+{
+  enum { N=100*BSIZE+123 };
+  int sizes[] = { 7, 100, BSIZE-1, BSIZE, 3*BSIZE+7, BUFSZ };
+  int i, n, stop;
+
+  mkbigfile(s, "ratest", N);
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    // shrink the cache, so that most blocks come from the disk.
+    countfree();
+    readbigfile(s, "ratest", N, sizes[i]);
+  }
+
+  stop = memhog(s, &n);
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++)
+    readbigfile(s, "ratest", N, sizes[i]);
+  close(stop);
+  wait(0);
+  unlink("ratest");
+}
+
+// does writing to p kill the process?
+int
+writekills(char *p)
+{
+  int pid, xstatus;
+
+  pid = fork();
+  if(pid < 0){
+    printf("fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    *(volatile char *)p = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  return xstatus == -1;
+}
+
+// sbrk() only reserves address space; pages are allocated
+// when first touched, by a fault or by a system call.
+void
+sbrklazy(char *s)
+{
+  enum { BIG=256*1024*1024, STEP=32*1024*1024 }; // more than the machine has
+  char *a, *b, *top;
+  uint64 i;
+  int fd, fds[2];
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(BIG) failed\n", s);
+    exit(1);
+  }
+
+  // touch a few pages far apart.
+  for(i = 0; i < BIG; i += STEP)
+    a[i] = 1 + i / STEP;
+  for(i = 0; i < BIG; i += STEP){
+    if(a[i] != 1 + i / STEP || a[i + 1] != 0){
+      printf("%s: wrong data at %p\n", s, a + i);
+      exit(1);
+    }
+  }
+
+  // shrink it all away and grow again: the pages come back zeroed.
+  if(sbrk(-BIG) != a + BIG){
+    printf("%s: sbrk(-BIG) failed\n", s);
+    exit(1);
+  }
+  if(!writekills(a + STEP)){
+    printf("%s: could write freed page %p\n", s, a + STEP);
+    exit(1);
+  }
+  b = sbrk(BIG);
+  if(b != a){
+    printf("%s: sbrk re-grow returned %p, not %p\n", s, b, a);
+    exit(1);
+  }
+  for(i = PGROUNDUP((uint64)a) - (uint64)a; i < BIG; i += STEP){
+    if(a[i] != 0){
+      printf("%s: %p not zero after shrink and re-grow\n", s, a + i);
+      exit(1);
+    }
+  }
+  sbrk(-BIG);
+
+  // system calls copy in and out of pages not yet touched.
+  a = sbrk(4 * PGSIZE);
+  b = (char*)PGROUNDUP((uint64)a);
+  fd = open("README", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open README failed\n", s);
+    exit(1);
+  }
+  if(read(fd, b + PGSIZE, 100) != 100){
+    printf("%s: read into an untouched page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("README", O_RDONLY);
+  if(read(fd, buf, 100) != 100 || memcmp(buf, b + PGSIZE, 100) != 0){
+    printf("%s: read into an untouched page got the wrong data\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], b + 2 * PGSIZE, 10) != 10){
+    printf("%s: write from an untouched page failed\n", s);
+    exit(1);
+  }
+  memset(buf, 1, 10);
+  if(read(fds[0], buf, 10) != 10){
+    printf("%s: pipe read failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 10; i++){
+    if(buf[i] != 0){
+      printf("%s: untouched page isn't zero\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // touching the page past the break kills the process
+  // rather than panicking the kernel.
+  top = (char*)PGROUNDUP((uint64)sbrk(0));
+  if(!writekills(top)){
+    printf("%s: could write %p, past the break\n", s, top);
+    exit(1);
+  }
+}
+
+// create file name holding n bytes, byte i being 'a' + i%23,
+// and return it open for reading and writing.
+int
+mkmapfile(char *s, char *name, int n)
+{
+  int fd;
+
+  for(int i = 0; i < n; i++)
+    buf[i] = 'a' + i % 23;
+  unlink(name);
+  fd = open(name, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create %s failed\n", s, name);
+    exit(1);
+  }
+  if(write(fd, buf, n) != n){
+    printf("%s: write %s failed\n", s, name);
+    exit(1);
+  }
+  return fd;
+}
+
+// a private file mapping starts out with the file's data,
+// and writes to it change neither the file nor other mappings.
+void
+mmapprivate(char *s)
+{
+  enum { N=2*PGSIZE+100 };
+  char *a, *b;
+  int fd, i;
+
+  fd = mkmapfile(s, "mmapprivate", N);
+  a = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  b = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(a == (char*)0xffffffffffffffffL || b == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3*PGSIZE; i++){
+    if(a[i] != (i < N ? 'a' + i % 23 : 0)){
+      printf("%s: wrong byte at offset %d\n", s, i);
+      exit(1);
+    }
+  }
+  for(i = 0; i < PGSIZE; i++)
+    a[i] = 'Z';
+  if(b[0] != 'a' || b[PGSIZE-1] != 'a' + (PGSIZE-1) % 23){
+    printf("%s: write to private mapping seen by another\n", s);
+    exit(1);
+  }
+  if(munmap(a, 3*PGSIZE) != 0 || munmap(b, PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapprivate", O_RDONLY);
+  if(read(fd, buf, PGSIZE) != PGSIZE){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < PGSIZE; i++){
+    if(buf[i] != 'a' + i % 23){
+      printf("%s: write to private mapping reached the file\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("mmapprivate");
+}
+
+// writes to a shared file mapping are written back to the
+// file by munmap().
+void
+mmapshared(char *s)
+{
+  char *a;
+  int fd, i;
+
+  fd = mkmapfile(s, "mmapshared", 2*PGSIZE);
+  a = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  // straddle the page boundary.
+  for(i = PGSIZE/2; i < PGSIZE + PGSIZE/2; i++)
+    a[i] = 'A' + i % 17;
+  if(munmap(a, 2*PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  fd = open("mmapshared", O_RDONLY);
+  if(read(fd, buf, 2*PGSIZE) != 2*PGSIZE){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*PGSIZE; i++){
+    if(buf[i] != (i >= PGSIZE/2 && i < PGSIZE + PGSIZE/2 ? 'A' + i % 17 : 'a' + i % 23)){
+      printf("%s: wrong byte in file at offset %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("mmapshared");
+}
+
+// munmap() of the middle of a mapping leaves the two ends.
+void
+mmaphole(char *s)
+{
+  char *a;
+  int fd, i;
+
+  a = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  pagefill(a, 3, 1);
+  if(munmap(a + PGSIZE, PGSIZE) != 0){
+    printf("%s: munmap of the middle page failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 1 || a[2*PGSIZE] != 3){
+    printf("%s: lost the ends of the mapping\n", s);
+    exit(1);
+  }
+  if(!writekills(a + PGSIZE)){
+    printf("%s: could write the hole\n", s);
+    exit(1);
+  }
+  // unmapping across the hole is fine.
+  if(munmap(a, 3*PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  if(!writekills(a) || !writekills(a + 2*PGSIZE)){
+    printf("%s: could write unmapped page\n", s);
+    exit(1);
+  }
+
+  // the end above a hole in a shared file mapping still
+  // writes back to the right offset.
+  fd = mkmapfile(s, "mmaphole", 3*PGSIZE);
+  a = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(munmap(a + PGSIZE, PGSIZE) != 0){
+    printf("%s: munmap of the middle page failed\n", s);
+    exit(1);
+  }
+  a[2*PGSIZE] = 'X';
+  if(munmap(a, 3*PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  fd = open("mmaphole", O_RDONLY);
+  if(read(fd, buf, 3*PGSIZE) != 3*PGSIZE){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3*PGSIZE; i++){
+    if(buf[i] != (i == 2*PGSIZE ? 'X' : 'a' + i % 23)){
+      printf("%s: wrong byte in file at offset %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("mmaphole");
+}
+
+// fork copies private mappings and shares shared ones.
+void
+mmapfork(char *s)
+{
+  char *priv, *shanon, *shfile;
+  int fd, pid, xstatus;
+
+  fd = mkmapfile(s, "mmapfork", PGSIZE);
+  priv = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  shanon = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  shfile = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(priv == (char*)0xffffffffffffffffL || shanon == (char*)0xffffffffffffffffL ||
+     shfile == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  priv[0] = 'p';
+  shanon[0] = 's';
+  shfile[0] = 'f';
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(priv[0] != 'p' || shanon[0] != 's' || shfile[0] != 'f' || shfile[1] != 'b'){
+      printf("%s: child doesn't see the parent's mappings\n", s);
+      exit(1);
+    }
+    priv[0] = 'P';
+    shanon[0] = 'S';
+    shfile[0] = 'F';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(priv[0] != 'p'){
+    printf("%s: child's write to a private mapping seen by parent\n", s);
+    exit(1);
+  }
+  if(shanon[0] != 'S' || shfile[0] != 'F'){
+    printf("%s: child's write to a shared mapping not seen by parent\n", s);
+    exit(1);
+  }
+  munmap(priv, PGSIZE);
+  munmap(shanon, PGSIZE);
+  munmap(shfile, PGSIZE);
+  unlink("mmapfork");
+}
+
+// mmap() and munmap() reject bad arguments.
+void
+mmapbad(char *s)
+{
+  char *a;
+  int fd, fds[2];
+
+  fd = mkmapfile(s, "mmapbad", PGSIZE);
+  close(fd);
+  fd = open("mmapbad", O_RDONLY);
+  if(fd < 0 || pipe(fds) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+
+  // bad file descriptors.
+  if(mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, 99, 0) != (char*)0xffffffffffffffffL ||
+     mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fds[0], 0) != (char*)0xffffffffffffffffL){
+    printf("%s: mapped a bad fd\n", s);
+    exit(1);
+  }
+
+  // bad protection and flags.
+  if(mmap(0, PGSIZE, PROT_READ|0x100, MAP_PRIVATE, fd, 0) != (char*)0xffffffffffffffffL){
+    printf("%s: mapped with unknown prot bits\n", s);
+    exit(1);
+  }
+  if(mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)0xffffffffffffffffL){
+    printf("%s: shared writable mapping of a read-only fd\n", s);
+    exit(1);
+  }
+  if(mmap(0, PGSIZE, PROT_READ, 0, fd, 0) != (char*)0xffffffffffffffffL ||
+     mmap(0, PGSIZE, PROT_READ, MAP_SHARED|MAP_PRIVATE, fd, 0) != (char*)0xffffffffffffffffL ||
+     mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE|0x1000, fd, 0) != (char*)0xffffffffffffffffL){
+    printf("%s: mapped with bad flags\n", s);
+    exit(1);
+  }
+
+  // bad lengths and alignment.
+  if(mmap(0, 0, PROT_READ, MAP_PRIVATE, fd, 0) != (char*)0xffffffffffffffffL ||
+     mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 100) != (char*)0xffffffffffffffffL){
+    printf("%s: mapped with a bad length or offset\n", s);
+    exit(1);
+  }
+  a = mmap(0, PGSIZE+1, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  // an unaligned length is rounded up to whole pages.
+  a[PGSIZE] = 1;
+  if(munmap(a + 100, PGSIZE) != -1 || munmap(a, 0) != -1){
+    printf("%s: munmap with a bad address or length\n", s);
+    exit(1);
+  }
+  if(munmap(a, PGSIZE+1) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  if(!writekills(a + PGSIZE)){
+    printf("%s: munmap left the last page\n", s);
+    exit(1);
+  }
+
+  close(fd);
+  close(fds[0]);
+  close(fds[1]);
+  unlink("mmapbad");
+}
+
+#define MB (1024*1024)
+#define MEGABIG (8*MB)
+
+// a is the start of a MEGABIG heap, and m a 2MB boundary with
+// at least one whole 2MB page of the heap on each side. each
+// page holds what pagefill(a, MEGABIG/PGSIZE, v) wrote. shrink
+// the heap to the middle of the 2MB page above m and grow it
+// again, checking the data is kept and the freed part comes
+// back zeroed.
+void
+megashrink(char *s, char *a, char *m, int v)
+{
+  int n = MEGABIG / PGSIZE, i;
+  char *mid = m + MB;
+
+  if(sbrk(-(a + MEGABIG - mid)) != a + MEGABIG){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  if((i = pagecheck(a, (mid - a) / PGSIZE, v)) >= 0){
+    printf("%s: page %d changed by shrink\n", s, i);
+    exit(1);
+  }
+  if(!writekills(mid)){
+    printf("%s: could write %p, past the break\n", s, mid);
+    exit(1);
+  }
+  if(sbrk(a + MEGABIG - mid) != mid){
+    printf("%s: sbrk re-grow failed\n", s);
+    exit(1);
+  }
+  for(i = (mid - a) / PGSIZE; i < n; i++){
+    if(a[(uint64)i * PGSIZE] != 0){
+      printf("%s: page %d not zero after re-grow\n", s, i);
+      exit(1);
+    }
+  }
+  if((i = pagecheck(a, (mid - a) / PGSIZE, v)) >= 0){
+    printf("%s: page %d changed by re-grow\n", s, i);
+    exit(1);
+  }
+
+  // touch it all again, so the split 2MB page can be whole again.
+  pagefill(a, n, v + 1);
+  if((i = pagecheck(a, n, v + 1)) >= 0){
+    printf("%s: page %d wrong after re-touch\n", s, i);
+    exit(1);
+  }
+}
+
+// page-align the heap, grow it by MEGABIG, touch every page,
+// and return the start; *m is set as megashrink() wants.
+char *
+megagrow(char *s, char **m)
+{
+  uint64 top = (uint64) sbrk(0);
+  char *a;
+  int i;
+
+  if((top % PGSIZE) != 0)
+    sbrk(PGSIZE - (top % PGSIZE));
+  a = sbrk(MEGABIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  *m = (char*)(((uint64)a + 4*MB - 1) & ~(uint64)(2*MB - 1));
+  pagefill(a, MEGABIG / PGSIZE, 1);
+  if((i = pagecheck(a, MEGABIG / PGSIZE, 1)) >= 0){
+    printf("%s: page %d wrong\n", s, i);
+    exit(1);
+  }
+  return a;
+}
+
+void
+sbrkmega1(char *s)
+{
+  char *a, *m;
+
+  a = megagrow(s, &m);
+  megashrink(s, a, m, 1);
+}
+
+void
+sbrkmegafork1(char *s)
+{
+  char *a, *m;
+  int pid, xstatus, i;
+
+  a = megagrow(s, &m);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if((i = pagecheck(a, MEGABIG / PGSIZE, 1)) >= 0){
+      printf("%s: child sees wrong page %d\n", s, i);
+      exit(1);
+    }
+    // write across m, copying part of the 2MB page on each side.
+    pagefill(m - MB, 2*MB / PGSIZE, 50);
+    if((i = pagecheck(m - MB, 2*MB / PGSIZE, 50)) >= 0){
+      printf("%s: child lost its write to page %d\n", s, i);
+      exit(1);
+    }
+    pagefill(a, MEGABIG / PGSIZE, 2);
+    megashrink(s, a, m, 2);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if((i = pagecheck(a, MEGABIG / PGSIZE, 1)) >= 0){
+    printf("%s: parent sees child's write to page %d\n", s, i);
+    exit(1);
+  }
+  megashrink(s, a, m, 1);
+}
+
+// large heaps get 2MB megapages where they can. freeing part
+// of one splits it, and touching every page of a split one
+// makes it whole again. are the data kept, and the pages
+// freed on exit?
+void
+sbrkmega(char *s)
+{
+  nopageleak(s, sbrkmega1);
+}
+
+// the same after fork, which shares the megapages
+// copy-on-write.
+void
+sbrkmegafork(char *s)
+{
+  nopageleak(s, sbrkmegafork1);
+}
+
 
 
 // regression test. test whether exec() leaks memory if one of the
@@ -2586,6 +3600,124 @@ badarg(char *s)
   exit(0);
 }
 
+// getsched() and setsched() check their arguments, a process
+// may only change the level of itself and its descendants,
+// only the shell and its direct children may change the
+// time slices, and the counters move.
+void
+schedtest(char *s)
+{
+  struct schedstat st, st1;
+  int nlevel, pid, ppid, xstatus, fds[2], t;
+  volatile int x = 0;
+  char c;
+
+  ppid = getpid();
+  if(getsched(0, &st) != 0 || st.pid != ppid){
+    printf("%s: getsched(0) failed\n", s);
+    exit(1);
+  }
+  if(getsched(ppid, &st1) != 0 || st1.pid != ppid){
+    printf("%s: getsched(pid) failed\n", s);
+    exit(1);
+  }
+  if(getsched(1000000, &st) != -1){
+    printf("%s: getsched of a missing pid succeeded\n", s);
+    exit(1);
+  }
+
+  // levels are 0 .. nlevel-1.
+  for(nlevel = 0; nlevel < 32; nlevel++)
+    if(setsched(SCHED_LEVEL, ppid, nlevel) != 0)
+      break;
+  if(nlevel < 2 || nlevel >= 32 || setsched(SCHED_LEVEL, ppid, -1) != -1){
+    printf("%s: bad level range, %d levels\n", s, nlevel);
+    exit(1);
+  }
+  if(getsched(0, &st) != 0 || st.level != nlevel - 1){
+    printf("%s: level %d, not %d\n", s, st.level, nlevel - 1);
+    exit(1);
+  }
+  if(setsched(99, 0, 0) != -1){
+    printf("%s: unknown op succeeded\n", s);
+    exit(1);
+  }
+
+  // a descendant's level, but not the parent's or init's.
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(setsched(SCHED_LEVEL, ppid, 0) != -1 || setsched(SCHED_LEVEL, 1, 0) != -1)
+      exit(1);
+    read(fds[0], &c, 1);
+    exit(0);
+  }
+  if(setsched(SCHED_LEVEL, pid, 2) != 0){
+    printf("%s: can't set child's level\n", s);
+    exit(1);
+  }
+  if(getsched(pid, &st) != 0 || st.level < 2){
+    printf("%s: child's level %d, not 2\n", s, st.level);
+    exit(1);
+  }
+  write(fds[1], "x", 1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child could change another's level\n", s);
+    exit(1);
+  }
+
+  // usertests' children are too deep in the tree to change
+  // the time slices, and so is an orphan that init adopted.
+  if(setsched(SCHED_SLICE, 0, 5) != -1){
+    printf("%s: test process changed a time slice\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(fork() == 0){
+      sleep(2); // until the parent has exited
+      c = setsched(SCHED_SLICE, 0, 5) == -1 ? 'y' : 'n';
+      write(fds[1], &c, 1);
+      exit(0);
+    }
+    exit(0);
+  }
+  wait(0);
+  if(read(fds[0], &c, 1) != 1 || c != 'y'){
+    printf("%s: orphan changed a time slice\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // sleeping counts as a voluntary switch; spinning through
+  // level 0's slice gets demoted.
+  getsched(0, &st);
+  sleep(1);
+  setsched(SCHED_LEVEL, ppid, 0);
+  t = uptime();
+  while(uptime() < t + 5)
+    x++;
+  getsched(0, &st1);
+  if(st1.nvcsw <= st.nvcsw || st1.ndemote <= st.ndemote ||
+     st1.runtime <= st.runtime){
+    printf("%s: counters didn't move\n", s);
+    exit(1);
+  }
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2628,6 +3760,8 @@ struct test {
   {subdir, "subdir"},
   {bigwrite, "bigwrite"},
   {bigfile, "bigfile"},
+  {bcachepressure, "bcachepressure"},
+  {readaheadtest, "readahead"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
@@ -2649,7 +3783,18 @@ struct test {
   {sbrkbugs, "sbrkbugs" },
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
+  {cowfork, "cowfork"},
+  {texttest, "texttest"},
+  {sbrklazy, "sbrklazy"},
+  {mmapprivate, "mmapprivate"},
+  {mmapshared, "mmapshared"},
+  {mmaphole, "mmaphole"},
+  {mmapfork, "mmapfork"},
+  {mmapbad, "mmapbad"},
+  {sbrkmega, "sbrkmega"},
+  {sbrkmegafork, "sbrkmegafork"},
   {badarg, "badarg" },
+  {schedtest, "schedtest" },
 
   { 0, 0},
 };
@@ -3104,6 +4249,8 @@ main(int argc, char *argv[])
     continuous = 1;
   } else if(argc == 2 && strcmp(argv[1], "-C") == 0){
     continuous = 2;
+  } else if(argc == 2 && strcmp(argv[1], "-x") == 0){
+    textchild();
   } else if(argc == 2 && argv[1][0] != '-'){
     justone = argv[1];
   } else if(argc > 1){
@@ -36,3 +36,7 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("getsched");
+entry("setsched");
+entry("mmap");
+entry("munmap");